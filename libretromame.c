@@ -5,10 +5,45 @@
  *
  ************************************************************************** **/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libmame/libmame.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "libretro.h"
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_SIMD 1
+#include <arm_neon.h>
+#endif
+
 #define LIBRARY_VERSION "1.0.0"
 
 /* ************************************************************************ */
@@ -22,7 +57,7 @@ static void PollAllControlsStateCb(LibMame_AllControlsState *all_states,
                                    void *callback_data);
 static void UpdateVideoCb(const LibMame_RenderPrimitive *render_primitive_list,
                           void *callback_data);
-static void UpdateAudioCb(int sample_rate, int samples_this_frame, 
+static void UpdateAudioCb(int sample_rate, int frame_count,
                           const int16_t *buffer, void *callback_data);
 static void SetMasterVolumeCb(int attenuation, void *callback_data);
 static void MakeRunningGameCallsCb(void *callback_data);
@@ -40,20 +75,89 @@ static retro_audio_sample_batch_t retroAudioSampleBatchG;
 static retro_input_poll_t retroInputPollG;
 static retro_input_state_t retroInputStateG;
 
-/* Global mutex and condition variables controlling runner thread */
-static pthread_mutex_t mutexG;
-static pthread_cond_t toRunnerCondG, fromRunnerCondG;
+/* Handoffs controlling the runner thread; the sequence number of
+   toRunnerG counts frames asked for by retro_run() and that of fromRunnerG
+   counts frames finished by the runner thread.  Both are defined below. */
+typedef struct Handoff Handoff;
+/* In pipelined mode the runner emulates one frame ahead of retro_run() */
+static bool pipelinedG;
+/* How the runner treats the video and audio of the frame being asked for;
+   set by the frontend thread before each request.  A hidden frame's video
+   is not converted and its audio never reaches the audio ring. */
+#define FRAME_HIDE_VIDEO 1
+#define FRAME_HIDE_AUDIO 2
+static volatile uint32_t frameFlagsG;
+/* Frames that retro_run() emulates beyond the one that counts, to show the
+   last of them and then take them all back; not used when pipelined */
+static unsigned int runAheadFramesG;
 
 static LibMame_RunningGame *runningGameG;
-static bool runningGameStopG;
+/* Set by the frontend thread, read by the runner thread */
+static volatile bool runningGameStopG;
+static volatile bool resetG;
 static int runningGameNumberG = -1;
 /* Values of the most recently received video frame */
 static uint32_t runningGameWidthG, runningGameHeightG;
 /* Values of the most recently received audio frame */
 static int runningGameSampleRateG;
+/* What retro_get_system_av_info() reports; filled in from the game's
+   metadata at load, so the frontend can set up once before any frame */
+static struct retro_system_av_info avInfoG;
+
+/* The sample rate that MAME is asked to mix at */
+#define AUDIO_SAMPLE_RATE 48000
+
+/* Whether the frontend accepts NULL frames meaning "same as the last one" */
+static bool canDupeG;
+/* Time that retro_run() has spent waiting for the runner this frame */
+static uint64_t frameWaitNsG;
+
+/* Pixel format negotiated with the frontend when the game was loaded */
+static enum retro_pixel_format pixelFormatG = RETRO_PIXEL_FORMAT_0RGB1555;
+/* Bytes per output pixel for pixelFormatG */
+#define PIXEL_FORMAT_BYTES(f) (((f) == RETRO_PIXEL_FORMAT_XRGB8888) ? 4 : 2)
+
+/* A video frame ready to be handed to the frontend */
+typedef struct VideoFrame
+{
+    const void *data;
+    unsigned int width, height;
+    size_t pitch;
+    /* Whether data is MAME's own texture rather than the frame arena, and
+       so only good until the runner continues */
+    bool borrowed;
+} VideoFrame;
 
-/* Next video frame */
-static uint16_t videoFrameG[1000 * 1000];
+/* The output of one emulated frame, filled in by the runner thread and
+   delivered to the frontend by retro_run() */
+typedef struct FrameSlot
+{
+    VideoFrame video;
+    bool video_valid;
+    /* Set when video is the same picture as the previous frame */
+    bool video_dupe;
+} FrameSlot;
+
+/* Frame N is always produced into slot N % FRAME_SLOTS; two slots are enough
+   for the runner to be at most one frame ahead */
+#define FRAME_SLOTS 2
+static FrameSlot frameSlotsG[FRAME_SLOTS];
+/* The frame most recently given to the frontend */
+static VideoFrame deliveredVideoG;
+
+/* Identifies the contents of a converted frame */
+typedef struct FrameKey
+{
+    uint64_t hash;
+    uint32_t width, height;
+    LibMame_TextureFormat format;
+} FrameKey;
+
+/* The last frame produced, used to spot frames that have not changed; only
+   touched by the runner thread */
+static VideoFrame lastFrameG;
+static FrameKey lastFrameKeyG;
+static bool lastFrameValidG;
 
 /* Options to use when running a game */
 static LibMame_RunGameOptions runGameOptionsG;
@@ -72,490 +176,6407 @@ LibMame_RunGameCallbacks runGameCallbacksG =
 
 
 /* ************************************************************************ */
+/* Pixel conversion kernels
 /* ************************************************************************ */
 
+/* Converts one MAME xRGB palette entry to a 0RGB1555 pixel */
+#define XRGB8888_TO_0RGB1555(xrgb)                                         \
+    ((uint16_t) ((((xrgb) >> 9) & 0x7c00) | (((xrgb) >> 6) & 0x03e0) |    \
+                 (((xrgb) >> 3) & 0x001f)))
 
-void retro_set_environment(retro_environment_t r)
-{
-    retroEnvironmentG = r;
-}
+/* Applies the brightness/contrast/gamma lookup tables that MAME supplies as
+   the "palette" of RGB32 textures: one 256 entry table per channel, each
+   entry already shifted into place */
+#define RGB32_LUT(palette, pix)                                            \
+    ((palette)[0x200 + (((pix) >> 16) & 0xff)] |                          \
+     (palette)[0x100 + (((pix) >> 8) & 0xff)] | (palette)[(pix) & 0xff])
 
+/* Converts count pixels from src to dest; palette is the texture palette */
+typedef void (*ConvertRowFn)(void *dest, const void *src,
+                             const uint32_t *palette, uint32_t count);
 
-void retro_set_video_refresh(retro_video_refresh_t r)
-{
-    retroVideoRefreshG = r;
-}
+/* Hashes bytes bytes of data, continuing from seed */
+typedef uint64_t (*HashFn)(const void *data, size_t bytes, uint64_t seed);
 
+/* Returns the largest of count 16 bit values */
+typedef uint16_t (*Max16Fn)(const uint16_t *data, uint32_t count);
 
-void retro_set_audio_sample(retro_audio_sample_t r)
-{
-    retroAudioSampleG = r;
-}
+/* Scales count audio samples from src into dest by a Q15 gain below one */
+typedef void (*GainFn)(int16_t *dest, const int16_t *src, size_t count,
+                       int16_t gain);
 
+/* Writes count output pixels to dest, pixel i being src[map[i]]; src must
+   be readable for two bytes past its last pixel */
+typedef void (*ScaleRowFn)(void *dest, const void *src, const uint32_t *map,
+                           uint32_t count);
 
-void retro_set_audio_sample_batch(retro_audio_sample_batch_t r)
+/* One line of a vector screen as the span kernels draw it: starting at ax,
+   ay and running dx, dy, with the inverse of its length squared (zero for a
+   dot); pixels within reach of it are lit, and color is its blue, green and
+   red light, scaled by its intensity */
+typedef struct VectorSpan
 {
-    retroAudioSampleBatchG = r;
-}
+    float ax, ay, dx, dy, inverse_length2, reach;
+    /* The inverse of dy, or zero for a line that is as good as
+       horizontal */
+    float inverse_dy;
+    uint16_t color[4];
+} VectorSpan;
 
+/* Adds the light of a line to count pixels of accumulated light, the first
+   of which is centred at x, y; SIMD kernels may go on for up to three more
+   pixels, which there must be room for */
+typedef void (*VectorSpanFn)(uint16_t *accum, uint32_t count, float x,
+                             float y, const VectorSpan *span);
 
-void retro_set_input_poll(retro_input_poll_t r)
+/* Converts count pixels of accumulated light to dest, and clears them */
+typedef void (*ResolveRowFn)(void *dest, uint16_t *accum, uint32_t count);
+
+/* The set of conversion kernels chosen for the host CPU at retro_init(),
+   indexed by the output pixel format, plus the kernels used to tell whether
+   a texture has changed and the one applying the master volume to audio */
+typedef struct ConvertKernels
 {
-    retroInputPollG = r;
-}
+    const char *name;
+    ConvertRowFn palette16[2];
+    ConvertRowFn rgb32[2];
+    ConvertRowFn yuy16[2];
+    /* Used by the compositor to stretch converted rows */
+    ScaleRowFn scale[2];
+    /* Used to draw vector screens */
+    VectorSpanFn vector_span;
+    ResolveRowFn resolve[2];
+    HashFn hash;
+    Max16Fn max16;
+    GainFn gain;
+} ConvertKernels;
 
+static ConvertKernels convertKernelsG;
 
-void retro_set_input_state(retro_input_state_t r)
+
+static void Palette16To0rgb1555_Scalar(void *dest, const void *src,
+                                       const uint32_t *palette,
+                                       uint32_t count)
 {
-    retroInputStateG = r;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    while (count >= 4) {
+        uint32_t p0 = palette[s[0]], p1 = palette[s[1]];
+        uint32_t p2 = palette[s[2]], p3 = palette[s[3]];
+        d[0] = XRGB8888_TO_0RGB1555(p0);
+        d[1] = XRGB8888_TO_0RGB1555(p1);
+        d[2] = XRGB8888_TO_0RGB1555(p2);
+        d[3] = XRGB8888_TO_0RGB1555(p3);
+        d += 4, s += 4, count -= 4;
+    }
+
+    while (count--) {
+        uint32_t p = palette[*s++];
+        *d++ = XRGB8888_TO_0RGB1555(p);
+    }
 }
 
 
-void retro_init()
+static void Palette16ToXrgb8888_Scalar(void *dest, const void *src,
+                                       const uint32_t *palette,
+                                       uint32_t count)
 {
-    /* retro_init() assumes success, so so will we */
-    (void) LibMame_Initialize();
+    uint32_t *d = (uint32_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
 
-    /* it is nonsensical for these to fail */
-    (void) pthread_mutex_init(&mutexG, 0);
-    (void) pthread_cond_init(&toRunnerCondG, 0);
-    (void) pthread_cond_init(&fromRunnerCondG, 0);
+    while (count >= 4) {
+        d[0] = palette[s[0]];
+        d[1] = palette[s[1]];
+        d[2] = palette[s[2]];
+        d[3] = palette[s[3]];
+        d += 4, s += 4, count -= 4;
+    }
 
-    /* Set up the libmame options */
-    LibMame_Get_Default_RunGameOptions(&runGameOptionsG);
-    runGameOptionsG.auto_frame_skip = 0;
-    runGameOptionsG.throttle = 0;
-    runGameOptionsG.sleep = 0;
-    runGameOptionsG.sound = 1;
-    runGameOptionsG.skip_gameinfo_screens = 1;
-    runGameOptionsG.quiet_startup = 1;
-    runGameOptionsG.use_backdrops = 0;
-    runGameOptionsG.use_overlays = 0;
-    runGameOptionsG.use_bezels = 0;
+    while (count--) {
+        *d++ = palette[*s++];
+    }
 }
 
 
-void retro_deinit()
+static void Rgb32To0rgb1555_Scalar(void *dest, const void *src,
+                                   const uint32_t *palette, uint32_t count)
 {
-    /* Not going to bother to enforce that retro_init() has occurred
-       successfully */
-    Libmame_Deinitialize();
+    uint16_t *d = (uint16_t *) dest;
+    const uint32_t *s = (const uint32_t *) src;
 
-    (void) pthread_mutex_destroy(&mutexG);
-    (void) pthread_cond_destroy(&toRunnerCondG);
-    (void) pthread_cond_destroy(&fromRunnerCondG);
+    if (palette) {
+        while (count--) {
+            uint32_t pix = *s++;
+            pix = RGB32_LUT(palette, pix);
+            *d++ = XRGB8888_TO_0RGB1555(pix);
+        }
+    }
+    else {
+        while (count--) {
+            uint32_t pix = *s++;
+            *d++ = XRGB8888_TO_0RGB1555(pix);
+        }
+    }
 }
 
 
-unsigned int retro_api_version()
+static void Rgb32ToXrgb8888_Scalar(void *dest, const void *src,
+                                   const uint32_t *palette, uint32_t count)
 {
-    return RETRO_API_VERSION;
+    uint32_t *d = (uint32_t *) dest;
+    const uint32_t *s = (const uint32_t *) src;
+
+    if (palette) {
+        while (count--) {
+            uint32_t pix = *s++;
+            *d++ = RGB32_LUT(palette, pix);
+        }
+    }
+    else {
+        /* Already in the output format */
+        memcpy(d, s, count * sizeof(uint32_t));
+    }
 }
 
 
-void retro_get_system_info(struct retro_system_info *info)
+/* MAME's YCbCr to RGB conversion (BT.601 studio swing), in the same integer
+   arithmetic so that every kernel gives the same result */
+static inline uint32_t YccToXrgb8888(int y, int cb, int cr)
 {
-    info->library_name = "libretromame";
-    info->library_version = LIBRARY_VERSION;
-    info->valid_extensions = "zip|ZIP|chd|CHD";
-    info->need_fullpath = true;
-    info->block_extract = true;
+    int common = (298 * (y - 16)) + 128;
+    int r = (common + (409 * (cr - 128))) >> 8;
+    int g = (common - (100 * (cb - 128)) - (208 * (cr - 128))) >> 8;
+    int b = (common + (516 * (cb - 128))) >> 8;
+
+    r = (r < 0) ? 0 : ((r > 255) ? 255 : r);
+    g = (g < 0) ? 0 : ((g > 255) ? 255 : g);
+    b = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+
+    return (((uint32_t) r) << 16) | (((uint32_t) g) << 8) | ((uint32_t) b);
 }
 
 
-void retro_get_system_av_info(struct retro_system_av_info *info)
+/* YUY16 texels come in pairs sharing their chroma: Y is the high byte of
+   each 16 bit word, Cb the low byte of the first and Cr the low byte of the
+   second.  The palette, if any, is MAME's 256 entry lookup table for Y.  An
+   odd last pixel has no Cr of its own and is given none. */
+static void Yuy16ToXrgb8888_Scalar(void *dest, const void *src,
+                                   const uint32_t *palette, uint32_t count)
 {
-    /* The width and height are only known after the first frame of video is
-       received */
-    info->geometry.base_width = runningGameWidthG;
-    info->geometry.base_height = runningGameHeightG;
-    info->geometry.max_width = runningGameWidthG;
-    info->geometry.max_height = runningGameHeightG;
-    /* The aspect ratio is defined by the base_width and base_height */
-    info->geometry.aspect_ratio = 0.0;
-    /* The timing is available from the running game number */
-    if (runningGameNumberG >= 0) {
-        info->timing.fps = 
-            LibMame_GetGame_ScreenRefreshRateHz(runningGameNumberG);
+    uint32_t *d = (uint32_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    for ( ; count >= 2; count -= 2, s += 2) {
+        int y0 = s[0] >> 8, y1 = s[1] >> 8;
+        if (palette) {
+            y0 = palette[y0] & 0xff;
+            y1 = palette[y1] & 0xff;
+        }
+        *d++ = YccToXrgb8888(y0, s[0] & 0xff, s[1] & 0xff);
+        *d++ = YccToXrgb8888(y1, s[0] & 0xff, s[1] & 0xff);
     }
-    else {
-        info->timing.fps = 0.0;
+
+    if (count) {
+        int y = s[0] >> 8;
+        if (palette) {
+            y = palette[y] & 0xff;
+        }
+        *d = YccToXrgb8888(y, s[0] & 0xff, 128);
     }
-    /* The audio sample rate is only known after the first frame of audio is
-       received */
-    info->timing.sample_rate = runningGameSampleRateG;
 }
 
 
-void retro_set_controller_port_device(unsigned port, unsigned device)
+static void Yuy16To0rgb1555_Scalar(void *dest, const void *src,
+                                   const uint32_t *palette, uint32_t count)
 {
-    /* Not sure what this is even supposed to do */
-    (void) port, (void) device;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    for ( ; count >= 2; count -= 2, s += 2) {
+        int y0 = s[0] >> 8, y1 = s[1] >> 8;
+        if (palette) {
+            y0 = palette[y0] & 0xff;
+            y1 = palette[y1] & 0xff;
+        }
+        *d++ = XRGB8888_TO_0RGB1555
+            (YccToXrgb8888(y0, s[0] & 0xff, s[1] & 0xff));
+        *d++ = XRGB8888_TO_0RGB1555
+            (YccToXrgb8888(y1, s[0] & 0xff, s[1] & 0xff));
+    }
+
+    if (count) {
+        int y = s[0] >> 8;
+        if (palette) {
+            y = palette[y] & 0xff;
+        }
+        *d = XRGB8888_TO_0RGB1555(YccToXrgb8888(y, s[0] & 0xff, 128));
+    }
 }
 
 
-static void *runner_main(void *)
+static void ScaleRow16_Scalar(void *dest, const void *src,
+                              const uint32_t *map, uint32_t count)
 {
-    if (runningGameNumberG != -1) {
-        LibMame_RunGameStatus status = LibMame_RunGame
-            (runningGameNumberG, true, &runGameOptionsG,
-             &runGameCallbacksG, NULL);
-        switch (status) {
-        case LibMame_RunGameStatus_Success:
-            break;
-        case LibMame_RunGameStatus_InvalidGameNum:
-            printf("Invalid game\n");
-            break;
-        case LibMame_RunGameStatus_FailedValidityCheck:
-            printf("Failed validity check\n");
-            break;
-        case LibMame_RunGameStatus_MissingFiles:
-            printf("Missing files\n");
-            break;
-        case LibMame_RunGameStatus_NoSuchGame:
-            printf("No such game\n");
-            break;
-        case LibMame_RunGameStatus_InvalidConfig:
-            printf("Invalid config\n");
-            break;
-        case LibMame_RunGameStatus_GeneralError:
-            printf("General error\n");
-        }
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    while (count--) {
+        *d++ = s[*map++];
     }
+}
 
-    runningGameNumberG = -1;
 
-    pthread_cond_signal(&fromRunnerThreadG);
+static void ScaleRow32_Scalar(void *dest, const void *src,
+                              const uint32_t *map, uint32_t count)
+{
+    uint32_t *d = (uint32_t *) dest;
+    const uint32_t *s = (const uint32_t *) src;
+
+    while (count--) {
+        *d++ = s[*map++];
+    }
 }
 
 
-void retro_reset()
+#ifdef HAVE_X86_SIMD
+
+/* Packs four xRGB pixels in each 32-bit lane of v down to 0RGB1555; the
+   result is left in the low 16 bits of each lane */
+__attribute__((target("sse2")))
+static inline __m128i Pack0rgb1555_SSE2(__m128i v)
 {
-    resetG = true;
-    pthread_cond_signal(&toRunnerCondG);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 9), _mm_set1_epi32(0x7c00));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(v, 6), _mm_set1_epi32(0x03e0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001f));
+    return _mm_or_si128(_mm_or_si128(r, g), b);
 }
 
 
-size_t retro_serialize_size()
+/* There is no gather before AVX2, so the lookups are done as an 8-wide
+   unrolled scalar load; the packing down to 1555 is done in vector
+   registers.  The packed values never exceed 0x7fff so the signed saturating
+   pack is exact. */
+__attribute__((target("sse2")))
+static void Palette16To0rgb1555_SSE2(void *dest, const void *src,
+                                     const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
-    return 0;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    while (count >= 8) {
+        __m128i lo = _mm_set_epi32(palette[s[3]], palette[s[2]],
+                                   palette[s[1]], palette[s[0]]);
+        __m128i hi = _mm_set_epi32(palette[s[7]], palette[s[6]],
+                                   palette[s[5]], palette[s[4]]);
+        _mm_storeu_si128((__m128i *) d,
+                         _mm_packs_epi32(Pack0rgb1555_SSE2(lo),
+                                         Pack0rgb1555_SSE2(hi)));
+        d += 8, s += 8, count -= 8;
+    }
+
+    Palette16To0rgb1555_Scalar(d, s, palette, count);
 }
 
 
-bool retro_serialize(void *data, size_t size)
+__attribute__((target("avx2")))
+static inline __m256i Pack0rgb1555_AVX2(__m256i v)
 {
-    /* Not supported yet */
-    (void) data, (void) size;
-    return false;
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 9),
+                                 _mm256_set1_epi32(0x7c00));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 6),
+                                 _mm256_set1_epi32(0x03e0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 3),
+                                 _mm256_set1_epi32(0x001f));
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
 }
 
 
-bool retro_unserialize(const void *data, size_t size)
+/* 16 pixels per iteration using the hardware gather.  The 256-bit pack
+   works within 128-bit lanes, hence the final qword permute to restore pixel
+   order. */
+__attribute__((target("avx2")))
+static void Palette16To0rgb1555_AVX2(void *dest, const void *src,
+                                     const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
-    (void) data, (void) size;
-    return false;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    while (count >= 16) {
+        __m256i idx_lo = _mm256_cvtepu16_epi32
+            (_mm_loadu_si128((const __m128i *) s));
+        __m256i idx_hi = _mm256_cvtepu16_epi32
+            (_mm_loadu_si128((const __m128i *) (s + 8)));
+        __m256i lo = _mm256_i32gather_epi32((const int *) palette, idx_lo, 4);
+        __m256i hi = _mm256_i32gather_epi32((const int *) palette, idx_hi, 4);
+        __m256i packed = _mm256_packs_epi32(Pack0rgb1555_AVX2(lo),
+                                            Pack0rgb1555_AVX2(hi));
+        _mm256_storeu_si256((__m256i *) d,
+                            _mm256_permute4x64_epi64(packed, 0xd8));
+        d += 16, s += 16, count -= 16;
+    }
+
+    Palette16To0rgb1555_SSE2(d, s, palette, count);
 }
 
 
-void retro_cheat_reset()
+__attribute__((target("avx2")))
+static void Palette16ToXrgb8888_AVX2(void *dest, const void *src,
+                                     const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
+    uint32_t *d = (uint32_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    while (count >= 8) {
+        __m256i idx = _mm256_cvtepu16_epi32
+            (_mm_loadu_si128((const __m128i *) s));
+        _mm256_storeu_si256((__m256i *) d, _mm256_i32gather_epi32
+                            ((const int *) palette, idx, 4));
+        d += 8, s += 8, count -= 8;
+    }
+
+    Palette16ToXrgb8888_Scalar(d, s, palette, count);
 }
 
 
-void retro_cheat_set(unsigned index, bool enabled, const char *code)
+/* Only the LUT-free case is vectorized; with a LUT every channel is a
+   scalar lookup anyway */
+__attribute__((target("sse2")))
+static void Rgb32To0rgb1555_SSE2(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
-    (void) index, (void) enabled, (void) code;
+    uint16_t *d = (uint16_t *) dest;
+    const uint32_t *s = (const uint32_t *) src;
+
+    if (!palette) {
+        while (count >= 8) {
+            __m128i lo = _mm_loadu_si128((const __m128i *) s);
+            __m128i hi = _mm_loadu_si128((const __m128i *) (s + 4));
+            _mm_storeu_si128((__m128i *) d,
+                             _mm_packs_epi32(Pack0rgb1555_SSE2(lo),
+                                             Pack0rgb1555_SSE2(hi)));
+            d += 8, s += 8, count -= 8;
+        }
+    }
+
+    Rgb32To0rgb1555_Scalar(d, s, palette, count);
 }
 
 
-bool retro_load_game_special(unsigned int game_type,
-                             const struct retro_game_info *info,
-                             size_t num_info)
+/* Two 16 bit multipliers for _mm_madd_epi16, applied to the low and high
+   halves of each 32 bit lane */
+#define YCC_MADD_PAIR(lo, hi)                                              \
+    _mm_set1_epi32((int) ((((uint32_t) (uint16_t) (hi)) << 16) |           \
+                          ((uint32_t) (uint16_t) (lo))))
+
+/* Converts eight YUY16 pixels to R, G and B, each clamped to 0..255 in a 16
+   bit lane.  Every pixel gets a 32 bit lane holding its C = Y - 16 and 1,
+   and one holding its pair's D = Cb - 128 and E = Cr - 128, so that each
+   channel is two multiply-adds with YccToXrgb8888()'s coefficients, the
+   rounding included. */
+__attribute__((target("sse2")))
+static inline void Yuy16ToRgb_SSE2(__m128i w, __m128i *r, __m128i *g,
+                                   __m128i *b)
 {
-    /* Not supported yet */
-    (void) game_type, (void) info, (void) num_info;
-    return false;
+    __m128i c = _mm_sub_epi16(_mm_srli_epi16(w, 8), _mm_set1_epi16(16));
+    __m128i de = _mm_sub_epi16(_mm_and_si128(w, _mm_set1_epi16(0xff)),
+                               _mm_set1_epi16(128));
+    __m128i one = _mm_set1_epi16(1);
+    __m128i c_lo = _mm_unpacklo_epi16(c, one);
+    __m128i c_hi = _mm_unpackhi_epi16(c, one);
+    __m128i de_lo = _mm_unpacklo_epi32(de, de);
+    __m128i de_hi = _mm_unpackhi_epi32(de, de);
+
+    __m128i m = YCC_MADD_PAIR(298, 128);
+    __m128i base_lo = _mm_madd_epi16(c_lo, m);
+    __m128i base_hi = _mm_madd_epi16(c_hi, m);
+
+    __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255);
+#define YCC_CHANNEL_SSE2(d, e)                                             \
+    _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32                            \
+        (_mm_srai_epi32(_mm_add_epi32                                      \
+            (base_lo, _mm_madd_epi16(de_lo, YCC_MADD_PAIR(d, e))), 8),     \
+         _mm_srai_epi32(_mm_add_epi32                                      \
+            (base_hi, _mm_madd_epi16(de_hi, YCC_MADD_PAIR(d, e))), 8)),    \
+                                zero), max)
+    *r = YCC_CHANNEL_SSE2(0, 409);
+    *g = YCC_CHANNEL_SSE2(-100, -208);
+    *b = YCC_CHANNEL_SSE2(516, 0);
+#undef YCC_CHANNEL_SSE2
 }
 
 
-bool retro_load_game(const struct retro_game_info *game)
+/* Only the case without a Y lookup table is vectorized, as for RGB32 */
+__attribute__((target("sse2")))
+static void Yuy16ToXrgb8888_SSE2(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    /* Extract the rompath and game name from the path */
-    char *c = game->path;
-    
-    char gamename[256];
-    
-    while (*c && (*c != '/') && (*c != '\\')) {
-        c += 1;
-    }
-    if (*c) {
-        c += 1;
-        snprintf(runGameOptionsG.rom_path, sizeof(runGameOptionsG.rom_path),
-                 "%.*s", c - game->path, game->path);
-        char *g = c;
-        while (*c && (*c != '.')) {
-            c += 1;
-        }
-        snprintf(gamename, sizeof(gamename), "%.*s", c - g, g);
-    }
-    else {
-        /* local file */
-        rompath[0] = '.';
-        rompath[1] = 0;
-        snprintf(gamename, sizeof(gamename), "%s", game->path);
-    }
-    
-    /* Eliminate file extension and tolower it */
-    c = gamename;
-    while (*c) {
-        if (*c == '.') {
-            *c = 0;
-            break;
-        }
-        else {
-            *c = tolower(*c);
-            c += 1;
+    uint32_t *d = (uint32_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+
+    if (!palette) {
+        while (count >= 8) {
+            __m128i r, g, b;
+            Yuy16ToRgb_SSE2(_mm_loadu_si128((const __m128i *) s), &r, &g, &b);
+            __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+            _mm_storeu_si128((__m128i *) d, _mm_unpacklo_epi16(gb, r));
+            _mm_storeu_si128((__m128i *) (d + 4), _mm_unpackhi_epi16(gb, r));
+            d += 8, s += 8, count -= 8;
         }
     }
-    
-    /* Look up the game */
-    runningGameNumberG = LibMame_Get_Game_Number(gamename);
-    
-    if (runningGameNumberG == -1) {
-        return false;
-    }
-
-    /* Clear the stop indicator */
-    runningGameStopG = false;
 
-    /* Start the runner thread */
-    pthread_t dontcare;
-    return (pthread_create(&dontcare, 0, runner_main, 0) == 0);
+    Yuy16ToXrgb8888_Scalar(d, s, palette, count);
 }
 
 
-void retro_run()
+__attribute__((target("sse2")))
+static void Yuy16To0rgb1555_SSE2(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    pthread_mutex_lock(&mutexG);
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
 
-    /* Signal the runner thread to continue for one frame */
-    pthread_cond_signal(&toRunnerCondG);
+    if (!palette) {
+        __m128i top5 = _mm_set1_epi16(0xf8);
+        while (count >= 8) {
+            __m128i r, g, b;
+            Yuy16ToRgb_SSE2(_mm_loadu_si128((const __m128i *) s), &r, &g, &b);
+            _mm_storeu_si128
+                ((__m128i *) d, _mm_or_si128
+                 (_mm_or_si128(_mm_slli_epi16(_mm_and_si128(r, top5), 7),
+                               _mm_slli_epi16(_mm_and_si128(g, top5), 2)),
+                  _mm_srli_epi16(b, 3)));
+            d += 8, s += 8, count -= 8;
+        }
+    }
 
-    /* Wait until it signals that it is done and return */
-    pthread_cond_wait(&fromRunnerCondG, &mutexG);
+    Yuy16To0rgb1555_Scalar(d, s, palette, count);
 }
 
 
-void retro_unload_game()
+/* 16 bit pixels are gathered as the 32 bits starting at each one, hence the
+   two bytes of slack required past the end of src */
+__attribute__((target("avx2")))
+static void ScaleRow16_AVX2(void *dest, const void *src,
+                            const uint32_t *map, uint32_t count)
 {
-    pthread_mutex_lock(&mutexG);
+    uint16_t *d = (uint16_t *) dest;
+    const int *s = (const int *) src;
+    __m256i low = _mm256_set1_epi32(0xffff);
 
-    if (runningGameNumberG != -1) {
-        /* Signal to the runner thread to exit */
-        runningGameStopG = true;
-        pthread_cond_signal(&toRunnerCondG, &mutexG);
+    while (count >= 16) {
+        __m256i lo = _mm256_and_si256
+            (_mm256_i32gather_epi32
+             (s, _mm256_loadu_si256((const __m256i *) map), 2), low);
+        __m256i hi = _mm256_and_si256
+            (_mm256_i32gather_epi32
+             (s, _mm256_loadu_si256((const __m256i *) (map + 8)), 2), low);
+        /* The pack works within 128 bit lanes, so put the quadwords back in
+           order afterwards */
+        _mm256_storeu_si256((__m256i *) d, _mm256_permute4x64_epi64
+                            (_mm256_packus_epi32(lo, hi), 0xd8));
+        d += 16, map += 16, count -= 16;
+    }
 
-        /* And wait for the thread to exit */
-        while (runningGameNumberG != -1) {
-            pthread_cond_wait(&fromRunnerCondG, &mutexG);
-        }
+    ScaleRow16_Scalar(d, src, map, count);
+}
+
+
+__attribute__((target("avx2")))
+static void ScaleRow32_AVX2(void *dest, const void *src,
+                            const uint32_t *map, uint32_t count)
+{
+    uint32_t *d = (uint32_t *) dest;
+    const int *s = (const int *) src;
 
-        /* Reset game-related values */
-        runningGameWidthG = runningGameHeightG = 0;
-        runningGameSampleRateG = 0;
+    while (count >= 8) {
+        _mm256_storeu_si256((__m256i *) d, _mm256_i32gather_epi32
+                            (s, _mm256_loadu_si256((const __m256i *) map),
+                             4));
+        d += 8, map += 8, count -= 8;
     }
+
+    ScaleRow32_Scalar(d, src, map, count);
 }
 
+#endif /* HAVE_X86_SIMD */
 
-unsigned int retro_get_region()
+
+#ifdef HAVE_NEON_SIMD
+
+static inline uint16x4_t Pack0rgb1555_NEON(uint32x4_t v)
 {
-    /* Not supported yet */
-    return 0;
+    uint32x4_t r = vandq_u32(vshrq_n_u32(v, 9), vdupq_n_u32(0x7c00));
+    uint32x4_t g = vandq_u32(vshrq_n_u32(v, 6), vdupq_n_u32(0x03e0));
+    uint32x4_t b = vandq_u32(vshrq_n_u32(v, 3), vdupq_n_u32(0x001f));
+    return vmovn_u32(vorrq_u32(vorrq_u32(r, g), b));
 }
 
 
-void *retro_get_memory_data(unsigned id)
+/* NEON has no gather either; same 8-wide unrolled lookup as SSE2 */
+static void Palette16To0rgb1555_NEON(void *dest, const void *src,
+                                     const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
-    (void) id;
-    return NULL;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
+    uint32_t lanes[8];
+
+    while (count >= 8) {
+        for (int i = 0; i < 8; i++) {
+            lanes[i] = palette[s[i]];
+        }
+        vst1q_u16(d, vcombine_u16(Pack0rgb1555_NEON(vld1q_u32(lanes)),
+                                  Pack0rgb1555_NEON(vld1q_u32(lanes + 4))));
+        d += 8, s += 8, count -= 8;
+    }
+
+    Palette16To0rgb1555_Scalar(d, s, palette, count);
 }
 
 
-size_t retro_get_memory_size(unsigned id)
+static void Rgb32To0rgb1555_NEON(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    /* Not supported yet */
-    return 0;
+    uint16_t *d = (uint16_t *) dest;
+    const uint32_t *s = (const uint32_t *) src;
+
+    if (!palette) {
+        while (count >= 8) {
+            vst1q_u16(d, vcombine_u16(Pack0rgb1555_NEON(vld1q_u32(s)),
+                                      Pack0rgb1555_NEON(vld1q_u32(s + 4))));
+            d += 8, s += 8, count -= 8;
+        }
+    }
+
+    Rgb32To0rgb1555_Scalar(d, s, palette, count);
 }
 
 
-static void StatusTextCb(const char *format, va_list args, void *callback_data)
+/* Same arithmetic as the SSE2 version, with widening multiply-accumulates;
+   the saturating narrowing shifts do the clamping */
+static inline void Yuy16ToRgb_NEON(uint16x8_t w, uint8x8_t *r, uint8x8_t *g,
+                                   uint8x8_t *b)
 {
-    (void) callback_data;
+    int16x8_t c = vsubq_s16(vreinterpretq_s16_u16(vshrq_n_u16(w, 8)),
+                            vdupq_n_s16(16));
+    int16x8_t ch = vsubq_s16(vreinterpretq_s16_u16
+                             (vandq_u16(w, vdupq_n_u16(0xff))),
+                             vdupq_n_s16(128));
+    /* Separate Cb from Cr, then give each pixel its pair's */
+    int16x8x2_t de = vuzpq_s16(ch, ch);
+    int16x8_t d = vzipq_s16(de.val[0], de.val[0]).val[0];
+    int16x8_t e = vzipq_s16(de.val[1], de.val[1]).val[0];
 
-    (void) vprintf(format, args);
+    int32x4_t base_lo = vmlal_n_s16(vdupq_n_s32(128), vget_low_s16(c), 298);
+    int32x4_t base_hi = vmlal_n_s16(vdupq_n_s32(128), vget_high_s16(c), 298);
+
+#define YCC_NARROW_NEON(lo, hi)                                            \
+    vqmovn_u16(vcombine_u16(vqshrun_n_s32(lo, 8), vqshrun_n_s32(hi, 8)))
+    *r = YCC_NARROW_NEON(vmlal_n_s16(base_lo, vget_low_s16(e), 409),
+                         vmlal_n_s16(base_hi, vget_high_s16(e), 409));
+    *g = YCC_NARROW_NEON(vmlal_n_s16(vmlal_n_s16(base_lo, vget_low_s16(d),
+                                                 -100),
+                                     vget_low_s16(e), -208),
+                         vmlal_n_s16(vmlal_n_s16(base_hi, vget_high_s16(d),
+                                                 -100),
+                                     vget_high_s16(e), -208));
+    *b = YCC_NARROW_NEON(vmlal_n_s16(base_lo, vget_low_s16(d), 516),
+                         vmlal_n_s16(base_hi, vget_high_s16(d), 516));
+#undef YCC_NARROW_NEON
 }
 
 
-static void StartingUpCb(LibMame_StartupPhase phase, int pct_complete,
-                         LibMame_RunningGame *running_game,
-                         void *callback_data)
+static void Yuy16ToXrgb8888_NEON(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    (void) callback_data;
-
-    runningGameG = running_game;
-    
-    const char *phase_name = "UNKNOWN";
+    uint32_t *d = (uint32_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
 
-    switch (phase) {
-    case LibMame_StartupPhase_Preparing:
-        phase_name = "Preparing";
-        break;
-    case LibMame_StartupPhase_LoadingRoms:
-        phase_name = "Loading Roms";
-        break;
-    case LibMame_StartupPhase_InitializingMachine:
-        phase_name = "Initializing Machine";
-        break;
+    if (!palette) {
+        while (count >= 8) {
+            uint8x8x4_t bgrx;
+            Yuy16ToRgb_NEON(vld1q_u16(s), &(bgrx.val[2]), &(bgrx.val[1]),
+                            &(bgrx.val[0]));
+            bgrx.val[3] = vdup_n_u8(0);
+            vst4_u8((uint8_t *) d, bgrx);
+            d += 8, s += 8, count -= 8;
+        }
     }
 
-    printf("Starting up: %s: %s - %d%%\n", 
-           LibMame_GetGame_Full_Name(runningGameNumberG), phase_name,
-           pct_complete);
+    Yuy16ToXrgb8888_Scalar(d, s, palette, count);
 }
 
 
-static void PollAllControlsStateCb(LibMame_AllControlsState *all_states,
-                                   void *callback_data)
+static void Yuy16To0rgb1555_NEON(void *dest, const void *src,
+                                 const uint32_t *palette, uint32_t count)
 {
-    (void) callback_data;
+    uint16_t *d = (uint16_t *) dest;
+    const uint16_t *s = (const uint16_t *) src;
 
-    if (!retroInputPollG || !retroInputStateG) {
-        return;
+    if (!palette) {
+        uint8x8_t top5 = vdup_n_u8(0xf8);
+        while (count >= 8) {
+            uint8x8_t r, g, b;
+            Yuy16ToRgb_NEON(vld1q_u16(s), &r, &g, &b);
+            vst1q_u16(d, vorrq_u16
+                      (vorrq_u16(vshlq_n_u16(vmovl_u8(vand_u8(r, top5)), 7),
+                                 vshlq_n_u16(vmovl_u8(vand_u8(g, top5)), 2)),
+                       vmovl_u8(vshr_n_u8(b, 3))));
+            d += 8, s += 8, count -= 8;
+        }
     }
 
-    /* Ask libretro front end to latch all controller input */
-    retroInputPollG();
+    Yuy16To0rgb1555_Scalar(d, s, palette, count);
+}
+
+#endif /* HAVE_NEON_SIMD */
 
-    /* Could be sophisticated and only query for those controls that the
-       running game needs, but for simplicity just query for everything */
-    unsigned int playerCount = 
-        LibMame_Get_Game_MaxSimultaneousPlayers(runningGameNumberG);
 
-    /* And, use a fairly simple fixed input mapping */
-    for (unsigned int i = 0; i < playerCount; i++) {
-        /* OK, not sure how to map anything here.  libretro names a
-           RETRO_DEVICE_KEYBOARD, which is the only one I am likely to
-           be able to use during development, but doesn't say anything about
-           what key ids there are */
-    }
+/* The hash kernels are not required to agree with each other, only to be
+   used consistently, so each uses whatever mixing suits its instruction set.
+   The scalar one is a four lane 64 bit multiply-rotate hash. */
+#define HASH_PRIME1 0x9e3779b185ebca87ull
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4full
+#define HASH_PRIME32_1 0x9e3779b1u
+#define HASH_PRIME32_2 0x85ebca77u
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t value)
+{
+    acc += value * HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * HASH_PRIME1;
 }
 
 
-static void UpdateVideoCb(const LibMame_RenderPrimitive *render_primitive_list,
-                          void *callback_data)
+static inline uint64_t HashFinish(uint64_t acc)
 {
-    if (!retroVideoRefreshG) {
-        return;
-    }
+    acc ^= acc >> 33;
+    acc *= HASH_PRIME2;
+    acc ^= acc >> 29;
+    return acc;
+}
+
 
-    const LibMame_RenderPrimitive *prim = render_primitive_list;
+static uint64_t Hash_Scalar(const void *data, size_t bytes, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t a0 = seed + HASH_PRIME1, a1 = seed ^ HASH_PRIME2;
+    uint64_t a2 = seed, a3 = seed - HASH_PRIME1;
+    uint64_t w[4];
+
+    seed = HashRound(seed, bytes);
 
-    /* Just render pixmaps; don't worry about vector games as to support them
-       properly, libretro needs vector graphics support in its API.  And just
-       render the first pixmap, as multi-quad games as they are pretty rare,
-       usually gambling machines, and doing the compositing in software would
-       be dumb */
-    while (prim && ((prim->type != LibMame_RenderPrimitiveType_Quad) ||
-                    !LIBMAME_RENDERFLAGS_SCREEN_TEXTURE(prim->flags))) {
-        prim = prim->next;
+    while (bytes >= 32) {
+        memcpy(w, p, 32);
+        a0 = HashRound(a0, w[0]);
+        a1 = HashRound(a1, w[1]);
+        a2 = HashRound(a2, w[2]);
+        a3 = HashRound(a3, w[3]);
+        p += 32, bytes -= 32;
     }
-    
-    if (!prim) {
-        return;
+
+    uint64_t acc = HashRound(HashRound(HashRound(HashRound(seed, a0), a1),
+                                       a2), a3);
+    while (bytes >= 8) {
+        memcpy(w, p, 8);
+        acc = HashRound(acc, w[0]);
+        p += 8, bytes -= 8;
+    }
+    if (bytes) {
+        w[0] = 0;
+        memcpy(w, p, bytes);
+        acc = HashRound(acc, w[0]);
+    }
+
+    return HashFinish(acc);
+}
+
+
+static uint16_t Max16_Scalar(const uint16_t *data, uint32_t count)
+{
+    uint16_t max = 0;
+
+    while (count--) {
+        uint16_t v = *data++;
+        max = (v > max) ? v : max;
+    }
+
+    return max;
+}
+
+
+/* Rounds the same way as _mm_mulhrs_epi16() and vqrdmulhq_s16(), so that
+   every kernel gives the same result; with a gain below one nothing can
+   overflow */
+static void Gain16_Scalar(int16_t *dest, const int16_t *src, size_t count,
+                          int16_t gain)
+{
+    while (count--) {
+        *dest++ = (int16_t) (((((int32_t) *src++) * gain) + 0x4000) >> 15);
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("avx2")))
+static inline __m256i HashRound_AVX2(__m256i acc, __m256i value)
+{
+    acc = _mm256_add_epi32
+        (acc, _mm256_mullo_epi32(value, _mm256_set1_epi32(HASH_PRIME32_2)));
+    acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13),
+                          _mm256_srli_epi32(acc, 19));
+    return _mm256_mullo_epi32(acc, _mm256_set1_epi32(HASH_PRIME32_1));
+}
+
+
+/* Sixteen 32 bit lanes in two accumulators, folded into the scalar hash at
+   the end */
+__attribute__((target("avx2")))
+static uint64_t Hash_AVX2(const void *data, size_t bytes, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    __m256i a0 = _mm256_set1_epi32((int) seed);
+    __m256i a1 = _mm256_set1_epi32((int) (seed >> 32));
+    uint32_t lanes[16];
+
+    if (bytes < 64) {
+        return Hash_Scalar(p, bytes, seed);
+    }
+
+    seed = HashRound(seed, bytes);
+
+    while (bytes >= 64) {
+        a0 = HashRound_AVX2(a0, _mm256_loadu_si256((const __m256i *) p));
+        a1 = HashRound_AVX2(a1, _mm256_loadu_si256
+                            ((const __m256i *) (p + 32)));
+        p += 64, bytes -= 64;
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, a0);
+    _mm256_storeu_si256((__m256i *) (lanes + 8), a1);
+    for (int i = 0; i < 16; i += 2) {
+        seed = HashRound(seed, ((uint64_t) lanes[i + 1] << 32) | lanes[i]);
+    }
+
+    return Hash_Scalar(p, bytes, seed);
+}
+
+
+__attribute__((target("sse4.1")))
+static uint16_t Max16_SSE41(const uint16_t *data, uint32_t count)
+{
+    __m128i max = _mm_setzero_si128();
+
+    while (count >= 8) {
+        max = _mm_max_epu16(max, _mm_loadu_si128((const __m128i *) data));
+        data += 8, count -= 8;
+    }
+
+    /* The horizontal minimum instruction finds the maximum of the
+       complement */
+    max = _mm_minpos_epu16(_mm_xor_si128(max, _mm_set1_epi16(-1)));
+    uint16_t result = (uint16_t) ~_mm_extract_epi16(max, 0);
+    uint16_t tail = Max16_Scalar(data, count);
+
+    return (tail > result) ? tail : result;
+}
+
+
+__attribute__((target("ssse3")))
+static void Gain16_SSSE3(int16_t *dest, const int16_t *src, size_t count,
+                         int16_t gain)
+{
+    __m128i g = _mm_set1_epi16(gain);
+
+    while (count >= 8) {
+        _mm_storeu_si128((__m128i *) dest, _mm_mulhrs_epi16
+                         (_mm_loadu_si128((const __m128i *) src), g));
+        dest += 8, src += 8, count -= 8;
+    }
+
+    Gain16_Scalar(dest, src, count, gain);
+}
+
+
+__attribute__((target("avx2")))
+static void Gain16_AVX2(int16_t *dest, const int16_t *src, size_t count,
+                        int16_t gain)
+{
+    __m256i g = _mm256_set1_epi16(gain);
+
+    while (count >= 16) {
+        _mm256_storeu_si256((__m256i *) dest, _mm256_mulhrs_epi16
+                            (_mm256_loadu_si256((const __m256i *) src), g));
+        dest += 16, src += 16, count -= 16;
+    }
+
+    Gain16_Scalar(dest, src, count, gain);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+#ifdef HAVE_NEON_SIMD
+
+static inline uint32x4_t HashRound_NEON(uint32x4_t acc, uint32x4_t value)
+{
+    acc = vmlaq_n_u32(acc, value, HASH_PRIME32_2);
+    acc = vorrq_u32(vshlq_n_u32(acc, 13), vshrq_n_u32(acc, 19));
+    return vmulq_n_u32(acc, HASH_PRIME32_1);
+}
+
+
+static uint64_t Hash_NEON(const void *data, size_t bytes, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint32x4_t a0 = vdupq_n_u32((uint32_t) seed);
+    uint32x4_t a1 = vdupq_n_u32((uint32_t) (seed >> 32));
+    uint32_t lanes[8];
+
+    if (bytes < 32) {
+        return Hash_Scalar(p, bytes, seed);
+    }
+
+    seed = HashRound(seed, bytes);
+
+    while (bytes >= 32) {
+        a0 = HashRound_NEON(a0, vreinterpretq_u32_u8(vld1q_u8(p)));
+        a1 = HashRound_NEON(a1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+        p += 32, bytes -= 32;
+    }
+
+    vst1q_u32(lanes, a0);
+    vst1q_u32(lanes + 4, a1);
+    for (int i = 0; i < 8; i += 2) {
+        seed = HashRound(seed, ((uint64_t) lanes[i + 1] << 32) | lanes[i]);
+    }
+
+    return Hash_Scalar(p, bytes, seed);
+}
+
+
+static uint16_t Max16_NEON(const uint16_t *data, uint32_t count)
+{
+    uint16x8_t max = vdupq_n_u16(0);
+    uint16_t lanes[8];
+
+    while (count >= 8) {
+        max = vmaxq_u16(max, vld1q_u16(data));
+        data += 8, count -= 8;
+    }
+
+    vst1q_u16(lanes, max);
+    uint16_t result = Max16_Scalar(lanes, 8);
+    uint16_t tail = Max16_Scalar(data, count);
+
+    return (tail > result) ? tail : result;
+}
+
+
+static void Gain16_NEON(int16_t *dest, const int16_t *src, size_t count,
+                        int16_t gain)
+{
+    while (count >= 8) {
+        vst1q_s16(dest, vqrdmulhq_n_s16(vld1q_s16(src), gain));
+        dest += 8, src += 8, count -= 8;
+    }
+
+    Gain16_Scalar(dest, src, count, gain);
+}
+
+#endif /* HAVE_NEON_SIMD */
+
+
+/* Adds the light of one line of a vector screen to pixels of a row of
+   accumulated light, which hold 16 bit blue, green, red and unused
+   channels in that order; 0xff00 is full brightness.  The pixels' coverage
+   by the beam falls off over the pixel beyond half its width. */
+static inline uint32_t VectorCoverage_Scalar(const VectorSpan *span, float rx,
+                                             float ry)
+{
+    float t = ((rx * span->dx) + (ry * span->dy)) * span->inverse_length2;
+    t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+    float ex = rx - (t * span->dx), ey = ry - (t * span->dy);
+    float coverage = span->reach - sqrtf((ex * ex) + (ey * ey));
+
+    return (coverage <= 0) ? 0 : (coverage >= 1) ? 256 :
+        (uint32_t) (coverage * 256);
+}
+
+
+static void VectorSpan_Scalar(uint16_t *accum, uint32_t count, float x,
+                              float y, const VectorSpan *span)
+{
+    float rx = x - span->ax, ry = y - span->ay;
+
+    while (count--) {
+        uint32_t q = VectorCoverage_Scalar(span, rx, ry);
+        if (q) {
+            for (int c = 0; c < 3; c++) {
+                uint32_t v = accum[c] + (span->color[c] * q);
+                accum[c] = (uint16_t) ((v > 0xffff) ? 0xffff : v);
+            }
+        }
+        accum += 4, rx += 1;
+    }
+}
+
+
+static void ResolveRow16_Scalar(void *dest, uint16_t *accum, uint32_t count)
+{
+    uint16_t *d = (uint16_t *) dest;
+
+    while (count--) {
+        *d++ = (uint16_t) (((accum[2] >> 11) << 10) |
+                           ((accum[1] >> 11) << 5) | (accum[0] >> 11));
+        memset(accum, 0, 4 * sizeof(uint16_t));
+        accum += 4;
+    }
+}
+
+
+static void ResolveRow32_Scalar(void *dest, uint16_t *accum, uint32_t count)
+{
+    uint32_t *d = (uint32_t *) dest;
+
+    while (count--) {
+        *d++ = (((uint32_t) (accum[2] >> 8) << 16) |
+                ((uint32_t) (accum[1] >> 8) << 8) | (accum[0] >> 8));
+        memset(accum, 0, 4 * sizeof(uint16_t));
+        accum += 4;
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* Four pixels at a time, running on past count to a multiple of four
+   rather than finishing with the scalar kernel, as most spans are only a
+   few pixels long; the coverage of each pixel is spread over its four
+   channels and multiplied by the line's colour */
+__attribute__((target("sse2")))
+static void VectorSpan_SSE2(uint16_t *accum, uint32_t count, float x,
+                            float y, const VectorSpan *span)
+{
+    __m128 dx = _mm_set1_ps(span->dx), dy = _mm_set1_ps(span->dy);
+    __m128 inverse = _mm_set1_ps(span->inverse_length2);
+    __m128 reach = _mm_set1_ps(span->reach);
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    __m128 ry = _mm_set1_ps(y - span->ay);
+    __m128 rx = _mm_add_ps(_mm_set1_ps(x - span->ax),
+                           _mm_setr_ps(0, 1, 2, 3));
+    __m128 ryy = _mm_mul_ps(ry, dy);
+    __m128i color = _mm_set_epi16(0, span->color[2], span->color[1],
+                                  span->color[0], 0, span->color[2],
+                                  span->color[1], span->color[0]);
+
+    while (count) {
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(rx, dx), ryy), inverse);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 ex = _mm_sub_ps(rx, _mm_mul_ps(t, dx));
+        __m128 ey = _mm_sub_ps(ry, _mm_mul_ps(t, dy));
+        __m128 coverage = _mm_sub_ps
+            (reach, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ex, ex),
+                                           _mm_mul_ps(ey, ey))));
+        coverage = _mm_min_ps(_mm_max_ps(coverage, zero), one);
+        if (_mm_movemask_ps(_mm_cmpgt_ps(coverage, zero))) {
+            __m128i q = _mm_cvttps_epi32(_mm_mul_ps(coverage,
+                                                    _mm_set1_ps(256)));
+            q = _mm_packs_epi32(q, q);
+            q = _mm_unpacklo_epi16(q, q);
+            __m128i *a = (__m128i *) accum;
+            _mm_storeu_si128(a, _mm_adds_epu16
+                             (_mm_loadu_si128(a), _mm_mullo_epi16
+                              (_mm_unpacklo_epi32(q, q), color)));
+            _mm_storeu_si128(a + 1, _mm_adds_epu16
+                             (_mm_loadu_si128(a + 1), _mm_mullo_epi16
+                              (_mm_unpackhi_epi32(q, q), color)));
+        }
+        rx = _mm_add_ps(rx, _mm_set1_ps(4));
+        accum += 16;
+        count = (count > 4) ? (count - 4) : 0;
+    }
+}
+
+
+__attribute__((target("sse2")))
+static void ResolveRow32_SSE2(void *dest, uint16_t *accum, uint32_t count)
+{
+    uint32_t *d = (uint32_t *) dest;
+    __m128i zero = _mm_setzero_si128();
+
+    while (count >= 4) {
+        __m128i *a = (__m128i *) accum;
+        __m128i lo = _mm_srli_epi16(_mm_loadu_si128(a), 8);
+        __m128i hi = _mm_srli_epi16(_mm_loadu_si128(a + 1), 8);
+        _mm_storeu_si128((__m128i *) d, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128(a, zero);
+        _mm_storeu_si128(a + 1, zero);
+        d += 4, accum += 16, count -= 4;
+    }
+
+    ResolveRow32_Scalar(d, accum, count);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/* Chooses the fastest kernels that the host CPU supports; setting
+   LIBRETROMAME_KERNELS=scalar in the environment forces the scalar ones,
+   for comparison and for ruling the SIMD kernels out when debugging */
+static void SelectConvertKernels()
+{
+    ConvertKernels *k = &convertKernelsG;
+
+    k->name = "scalar";
+    k->palette16[RETRO_PIXEL_FORMAT_0RGB1555] = Palette16To0rgb1555_Scalar;
+    k->palette16[RETRO_PIXEL_FORMAT_XRGB8888] = Palette16ToXrgb8888_Scalar;
+    k->rgb32[RETRO_PIXEL_FORMAT_0RGB1555] = Rgb32To0rgb1555_Scalar;
+    k->rgb32[RETRO_PIXEL_FORMAT_XRGB8888] = Rgb32ToXrgb8888_Scalar;
+    k->yuy16[RETRO_PIXEL_FORMAT_0RGB1555] = Yuy16To0rgb1555_Scalar;
+    k->yuy16[RETRO_PIXEL_FORMAT_XRGB8888] = Yuy16ToXrgb8888_Scalar;
+    k->scale[RETRO_PIXEL_FORMAT_0RGB1555] = ScaleRow16_Scalar;
+    k->scale[RETRO_PIXEL_FORMAT_XRGB8888] = ScaleRow32_Scalar;
+    k->vector_span = VectorSpan_Scalar;
+    k->resolve[RETRO_PIXEL_FORMAT_0RGB1555] = ResolveRow16_Scalar;
+    k->resolve[RETRO_PIXEL_FORMAT_XRGB8888] = ResolveRow32_Scalar;
+    k->hash = Hash_Scalar;
+    k->max16 = Max16_Scalar;
+    k->gain = Gain16_Scalar;
+
+    const char *force = getenv("LIBRETROMAME_KERNELS");
+    if (force && !strcmp(force, "scalar")) {
+        return;
+    }
+
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        k->name = "sse2";
+        k->palette16[RETRO_PIXEL_FORMAT_0RGB1555] = Palette16To0rgb1555_SSE2;
+        k->rgb32[RETRO_PIXEL_FORMAT_0RGB1555] = Rgb32To0rgb1555_SSE2;
+        k->yuy16[RETRO_PIXEL_FORMAT_0RGB1555] = Yuy16To0rgb1555_SSE2;
+        k->yuy16[RETRO_PIXEL_FORMAT_XRGB8888] = Yuy16ToXrgb8888_SSE2;
+        k->vector_span = VectorSpan_SSE2;
+        k->resolve[RETRO_PIXEL_FORMAT_XRGB8888] = ResolveRow32_SSE2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        k->gain = Gain16_SSSE3;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        k->max16 = Max16_SSE41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        k->name = "avx2";
+        k->palette16[RETRO_PIXEL_FORMAT_0RGB1555] = Palette16To0rgb1555_AVX2;
+        k->palette16[RETRO_PIXEL_FORMAT_XRGB8888] = Palette16ToXrgb8888_AVX2;
+        k->scale[RETRO_PIXEL_FORMAT_0RGB1555] = ScaleRow16_AVX2;
+        k->scale[RETRO_PIXEL_FORMAT_XRGB8888] = ScaleRow32_AVX2;
+        k->hash = Hash_AVX2;
+        k->gain = Gain16_AVX2;
+    }
+#elif defined(HAVE_NEON_SIMD)
+    k->name = "neon";
+    k->palette16[RETRO_PIXEL_FORMAT_0RGB1555] = Palette16To0rgb1555_NEON;
+    k->rgb32[RETRO_PIXEL_FORMAT_0RGB1555] = Rgb32To0rgb1555_NEON;
+    k->yuy16[RETRO_PIXEL_FORMAT_0RGB1555] = Yuy16To0rgb1555_NEON;
+    k->yuy16[RETRO_PIXEL_FORMAT_XRGB8888] = Yuy16ToXrgb8888_NEON;
+    /* Vector screens stay on the scalar kernels here until NEON ones have
+       been checked against them on ARM */
+    k->hash = Hash_NEON;
+    k->max16 = Max16_NEON;
+    k->gain = Gain16_NEON;
+#endif
+}
+
+
+/* ************************************************************************ */
+/* Frame arena
+/* ************************************************************************ */
+
+/* Converted frames are written into one of FRAME_ARENA_BUFFERS buffers in
+   turn, so that the runner thread can convert frame N+1 while the frontend
+   is still presenting frame N.  Buffers and rows are FRAME_ARENA_ALIGN byte
+   aligned for the benefit of the conversion kernels.
+
+   Each buffer also remembers the hash of the source row that every one of
+   its rows was converted from, so that a new frame only needs the rows that
+   differ from what the buffer already holds to be converted into it.
+
+   While exporting, the buffers are allocated in the export object instead
+   of on the heap, and each buffer's generation count there is bumped as its
+   next frame starts being written. */
+#define FRAME_ARENA_BUFFERS 2
+#define FRAME_ARENA_ALIGN 64
+#define FRAME_ARENA_ALIGN_UP(n)                                            \
+    (((n) + (FRAME_ARENA_ALIGN - 1)) & ~((size_t) (FRAME_ARENA_ALIGN - 1)))
+
+/* What the rows of one buffer were converted from */
+typedef struct FrameArenaContents
+{
+    /* Hash of the palette entries in use and shape of the source texture;
+       for a composited frame, the compositor layout and no format */
+    uint64_t palette_hash;
+    uint32_t width;
+    LibMame_TextureFormat format;
+    size_t pitch;
+    /* False until the buffer holds a converted frame */
+    bool valid;
+} FrameArenaContents;
+
+typedef struct FrameArena
+{
+    /* Single allocation holding all of the buffers */
+    uint8_t *base;
+    /* Previous allocation, kept until the next growth because the frontend
+       may still be presenting from it */
+    uint8_t *retired;
+    /* Size in bytes of each buffer */
+    size_t buffer_size;
+    /* Index of the buffer that the next frame will be written into */
+    unsigned int next;
+    /* Row hashes of the frame being produced, followed by the row hashes of
+       each buffer; row_capacity rows each */
+    uint64_t *row_hashes;
+    uint32_t row_capacity;
+    FrameArenaContents contents[FRAME_ARENA_BUFFERS];
+    /* Whether the buffers are in the export object, and if so, their
+       generation counts there */
+    bool exported;
+    volatile uint32_t *generations;
+} FrameArena;
+
+static FrameArena frameArenaG;
+
+static void *Export_Allocate(size_t size);
+static void Export_Release(void *base);
+
+
+/* Row pitch used for a frame of the given width in the arena */
+static size_t FrameArena_Pitch(uint32_t width)
+{
+    return FRAME_ARENA_ALIGN_UP(width * PIXEL_FORMAT_BYTES(pixelFormatG));
+}
+
+
+/* Forgets what every buffer holds, so that the next frames are converted in
+   full */
+static void FrameArena_Invalidate(FrameArena *arena)
+{
+    for (unsigned int i = 0; i < FRAME_ARENA_BUFFERS; i++) {
+        arena->contents[i].valid = false;
+    }
+}
+
+
+/* Makes sure that every buffer can hold a width x height frame, growing the
+   arena if necessary; returns false on allocation failure */
+static bool FrameArena_Reserve(FrameArena *arena, uint32_t width,
+                               uint32_t height)
+{
+    size_t needed = FrameArena_Pitch(width) * height;
+
+    if (arena->base && (needed <= arena->buffer_size)) {
+        return true;
+    }
+
+    void *base;
+    if (arena->exported) {
+        if (!(base = Export_Allocate(FRAME_ARENA_BUFFERS * needed))) {
+            return false;
+        }
+        Export_Release(arena->retired);
+    }
+    else {
+        if (posix_memalign(&base, FRAME_ARENA_ALIGN,
+                           FRAME_ARENA_BUFFERS * needed)) {
+            return false;
+        }
+        free(arena->retired);
+    }
+
+    arena->retired = arena->base;
+    arena->base = (uint8_t *) base;
+    arena->buffer_size = needed;
+    arena->next = 0;
+    FrameArena_Invalidate(arena);
+
+    return true;
+}
+
+
+/* Makes sure that there are row hashes for frames of the given height;
+   returns false on allocation failure */
+static bool FrameArena_ReserveRows(FrameArena *arena, uint32_t height)
+{
+    if (arena->row_hashes && (height <= arena->row_capacity)) {
+        return true;
+    }
+
+    uint64_t *row_hashes = (uint64_t *) malloc
+        ((FRAME_ARENA_BUFFERS + 1) * (size_t) height * sizeof(uint64_t));
+    if (!row_hashes) {
+        return false;
+    }
+
+    free(arena->row_hashes);
+    arena->row_hashes = row_hashes;
+    arena->row_capacity = height;
+    FrameArena_Invalidate(arena);
+
+    return true;
+}
+
+
+/* Returns the row hashes of a buffer, or with buffer == FRAME_ARENA_BUFFERS,
+   of the frame being produced */
+static uint64_t *FrameArena_RowHashes(FrameArena *arena, unsigned int buffer)
+{
+    return arena->row_hashes + ((size_t) buffer * arena->row_capacity);
+}
+
+
+/* Returns the buffer that the next frame should be written into */
+static void *FrameArena_Next(FrameArena *arena)
+{
+    void *buffer = arena->base + (arena->next * arena->buffer_size);
+
+    if (arena->generations) {
+        uint32_t generation = arena->generations[arena->next];
+        __atomic_store_n(&(arena->generations[arena->next]),
+                         generation + ((generation & 1) ? 2 : 1),
+                         __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    arena->next = (arena->next + 1) % FRAME_ARENA_BUFFERS;
+
+    return buffer;
+}
+
+
+static void FrameArena_Free(FrameArena *arena)
+{
+    if (arena->exported) {
+        Export_Release(arena->base);
+        Export_Release(arena->retired);
+    }
+    else {
+        free(arena->base);
+        free(arena->retired);
+    }
+    free(arena->row_hashes);
+    memset(arena, 0, sizeof(*arena));
+}
+
+
+/* ************************************************************************ */
+/* ************************************************************************ */
+
+
+/* ************************************************************************ */
+/* Frame handoff
+/* ************************************************************************ */
+
+/* A one-way signal from one thread to another carrying a sequence number.
+   The poster bumps the sequence number; the waiter waits for it to reach a
+   target.  Waiting spins briefly before sleeping, and the spin length adapts
+   to how often spinning actually catches the post.  On Linux the sleep is a
+   futex wait on the sequence number itself; elsewhere it falls back to a
+   condition variable. */
+struct Handoff
+{
+    volatile uint32_t sequence;
+    /* Set when the posting side has gone away for good */
+    volatile uint32_t closed;
+    /* Number of threads asleep (or about to be) on this handoff */
+    volatile uint32_t sleepers;
+    /* Current spin budget, in iterations; shared by every waiter, which
+       may all adjust it, so it is only accessed atomically */
+    uint32_t spin;
+#ifndef __linux__
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+#define HANDOFF_SPIN_MIN 64
+#define HANDOFF_SPIN_MAX (64 * 1024)
+
+static Handoff toRunnerG, fromRunnerG;
+/* Spinning only helps if the other thread has a CPU of its own */
+static bool handoffSpinG;
+/* CPU to pin the runner thread to, or -1 */
+static int runnerCpuG = -1;
+
+
+static inline void Handoff_CpuRelax()
+{
+#if defined(HAVE_X86_SIMD)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+
+static void Handoff_Initialize(Handoff *h)
+{
+    h->sequence = 0;
+    h->closed = 1;
+    h->sleepers = 0;
+    __atomic_store_n(&(h->spin), HANDOFF_SPIN_MIN, __ATOMIC_RELAXED);
+#ifndef __linux__
+    (void) pthread_mutex_init(&(h->mutex), 0);
+    (void) pthread_cond_init(&(h->cond), 0);
+#endif
+}
+
+
+static void Handoff_Destroy(Handoff *h)
+{
+#ifndef __linux__
+    (void) pthread_mutex_destroy(&(h->mutex));
+    (void) pthread_cond_destroy(&(h->cond));
+#else
+    (void) h;
+#endif
+}
+
+
+static void Handoff_Wake(Handoff *h)
+{
+    if (!__atomic_load_n(&(h->sleepers), __ATOMIC_SEQ_CST)) {
+        return;
+    }
+#ifdef __linux__
+    (void) syscall(SYS_futex, &(h->sequence), FUTEX_WAKE_PRIVATE, INT32_MAX,
+                   NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&(h->mutex));
+    pthread_cond_broadcast(&(h->cond));
+    pthread_mutex_unlock(&(h->mutex));
+#endif
+}
+
+
+/* Resets the sequence number and allows posts again; only called while
+   nobody is waiting */
+static void Handoff_Open(Handoff *h)
+{
+    h->sequence = 0;
+    __atomic_store_n(&(h->closed), 0, __ATOMIC_RELEASE);
+}
+
+
+/* Wakes any waiter for good; Handoff_Wait() returns false from now on */
+static void Handoff_Close(Handoff *h)
+{
+    __atomic_store_n(&(h->closed), 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(h->sequence), 1, __ATOMIC_SEQ_CST);
+    Handoff_Wake(h);
+}
+
+
+static inline uint32_t Handoff_Sequence(const Handoff *h)
+{
+    return __atomic_load_n(&(h->sequence), __ATOMIC_ACQUIRE);
+}
+
+
+/* Everything written before the post is visible to the thread whose wait it
+   satisfies */
+static void Handoff_Post(Handoff *h)
+{
+    __atomic_add_fetch(&(h->sequence), 1, __ATOMIC_SEQ_CST);
+    Handoff_Wake(h);
+}
+
+
+/* Sequence numbers wrap, so compare them as a signed distance */
+static inline bool Handoff_Reached(uint32_t sequence, uint32_t target)
+{
+    return ((int32_t) (sequence - target) >= 0);
+}
+
+
+/* Waits for the sequence number to reach target; returns false if the
+   handoff was closed instead */
+static bool Handoff_Wait(Handoff *h, uint32_t target)
+{
+    uint32_t sequence;
+
+    if (handoffSpinG) {
+        /* Waiters racing to adjust the budget can only lose each other's
+           adjustments, which is harmless */
+        uint32_t spin = __atomic_load_n(&(h->spin), __ATOMIC_RELAXED);
+        for (uint32_t i = 0; i < spin; i++) {
+            sequence = Handoff_Sequence(h);
+            if (Handoff_Reached(sequence, target) ||
+                __atomic_load_n(&(h->closed), __ATOMIC_ACQUIRE)) {
+                /* Spinning paid off; allow a little more next time */
+                if (spin < HANDOFF_SPIN_MAX) {
+                    __atomic_store_n(&(h->spin), spin * 2, __ATOMIC_RELAXED);
+                }
+                return !__atomic_load_n(&(h->closed), __ATOMIC_ACQUIRE);
+            }
+            Handoff_CpuRelax();
+        }
+        /* It didn't; spin less next time */
+        if (spin > HANDOFF_SPIN_MIN) {
+            __atomic_store_n(&(h->spin), spin / 2, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_add_fetch(&(h->sleepers), 1, __ATOMIC_SEQ_CST);
+    while (true) {
+        sequence = __atomic_load_n(&(h->sequence), __ATOMIC_SEQ_CST);
+        if (Handoff_Reached(sequence, target) ||
+            __atomic_load_n(&(h->closed), __ATOMIC_SEQ_CST)) {
+            break;
+        }
+#ifdef __linux__
+        /* Returns immediately if the sequence number has already moved on */
+        (void) syscall(SYS_futex, &(h->sequence), FUTEX_WAIT_PRIVATE,
+                       sequence, NULL, NULL, 0);
+#else
+        pthread_mutex_lock(&(h->mutex));
+        if (__atomic_load_n(&(h->sequence), __ATOMIC_SEQ_CST) == sequence) {
+            pthread_cond_wait(&(h->cond), &(h->mutex));
+        }
+        pthread_mutex_unlock(&(h->mutex));
+#endif
+    }
+    __atomic_sub_fetch(&(h->sleepers), 1, __ATOMIC_SEQ_CST);
+
+    return !__atomic_load_n(&(h->closed), __ATOMIC_ACQUIRE);
+}
+
+
+/* Pins the calling thread to one CPU; a negative cpu leaves it alone */
+static void PinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    (void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpu;
+#endif
+}
+
+
+/* ************************************************************************ */
+/* Log ring
+/* ************************************************************************ */
+
+/* Everything the core prints goes through a bounded ring of fixed-size
+   messages, written out by a thread of its own, so that a slow or blocked
+   stdout can never hold up the runner or the frontend thread.  Posting
+   formats into a slot claimed with a compare-and-swap (any thread may post)
+   and never waits: when the ring is full the message is dropped and
+   counted, and the writer reports how many were lost.  Warnings and errors
+   are also passed on to retro_run(), which shows the latest one through
+   RETRO_ENVIRONMENT_SET_MESSAGE. */
+#define LOG_RING_SLOTS 256
+#define LOG_MESSAGE_MAX 248
+/* How long a message stays on screen */
+#define LOG_NOTICE_FRAMES 240
+
+typedef enum LogLevel
+{
+    LogLevel_Debug,
+    LogLevel_Info,
+    LogLevel_Warning,
+    LogLevel_Error,
+    LogLevel_Count
+} LogLevel;
+
+typedef struct LogSlot
+{
+    /* The slot's position in the ring plus one once its message is ready;
+       the position of its next use once the writer is done with it */
+    volatile uint32_t sequence;
+    uint16_t level, length;
+    char text[LOG_MESSAGE_MAX];
+} LogSlot;
+
+typedef struct LogNotice
+{
+    /* Odd while the text is being written */
+    volatile uint32_t sequence;
+    char text[LOG_MESSAGE_MAX];
+} LogNotice;
+
+typedef struct LogRing
+{
+    LogSlot slots[LOG_RING_SLOTS];
+    /* Next position to claim, by any thread */
+    volatile uint32_t head;
+    /* Next position to write out; writer only */
+    uint32_t tail;
+    /* Messages below this level are not posted */
+    volatile uint32_t min_level;
+    volatile uint64_t posted[LogLevel_Count], dropped[LogLevel_Count];
+    /* Writer only: drops already reported */
+    uint64_t reported;
+    Handoff wake;
+    pthread_t thread;
+    bool running;
+    LogNotice notice;
+    /* Frontend thread only: the last notice shown */
+    uint32_t shown;
+} LogRing;
+
+static LogRing logRingG;
+
+
+/* Writer only: writes out one message */
+static void Log_Write(LogRing *ring, LogLevel level, const char *text,
+                      size_t length)
+{
+    (void) fwrite(text, 1, length, stdout);
+
+    if (level < LogLevel_Warning) {
+        return;
+    }
+
+    /* Under a sequence lock, as retro_run() may be reading the last one */
+    LogNotice *notice = &(ring->notice);
+    while (length && (text[length - 1] == '\n')) {
+        length -= 1;
+    }
+    __atomic_add_fetch(&(notice->sequence), 1, __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(notice->text, text, length);
+    notice->text[length] = 0;
+    __atomic_add_fetch(&(notice->sequence), 1, __ATOMIC_RELEASE);
+}
+
+
+/* Writer only: writes out everything posted so far */
+static void Log_Drain(LogRing *ring)
+{
+    bool wrote = false;
+
+    while (true) {
+        LogSlot *slot = &(ring->slots[ring->tail % LOG_RING_SLOTS]);
+        if (__atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE) !=
+            (ring->tail + 1)) {
+            break;
+        }
+        Log_Write(ring, (LogLevel) slot->level, slot->text, slot->length);
+        __atomic_store_n(&(slot->sequence), ring->tail + LOG_RING_SLOTS,
+                         __ATOMIC_RELEASE);
+        ring->tail += 1;
+        wrote = true;
+    }
+
+    uint64_t dropped = 0;
+    for (int i = 0; i < LogLevel_Count; i++) {
+        dropped += __atomic_load_n(&(ring->dropped[i]), __ATOMIC_RELAXED);
+    }
+    if (dropped != ring->reported) {
+        char text[64];
+        int length = snprintf(text, sizeof(text),
+                              "libretromame: %llu log messages dropped\n",
+                              (unsigned long long) (dropped - ring->reported));
+        Log_Write(ring, LogLevel_Info, text, (size_t) length);
+        ring->reported = dropped;
+        wrote = true;
+    }
+
+    if (wrote) {
+        (void) fflush(stdout);
+    }
+}
+
+
+static void *Log_Main(void *arg)
+{
+    LogRing *ring = (LogRing *) arg;
+
+    while (true) {
+        uint32_t sequence = Handoff_Sequence(&(ring->wake));
+        Log_Drain(ring);
+        if (!Handoff_Wait(&(ring->wake), sequence + 1)) {
+            break;
+        }
+    }
+
+    /* Whatever was posted before the ring was stopped */
+    Log_Drain(ring);
+
+    return NULL;
+}
+
+
+static void Log_Start(LogRing *ring)
+{
+    ring->head = ring->tail = 0;
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->min_level = LogLevel_Info;
+
+    Handoff_Initialize(&(ring->wake));
+    Handoff_Open(&(ring->wake));
+    ring->running = !pthread_create(&(ring->thread), NULL, &Log_Main, ring);
+}
+
+
+static void Log_Stop(LogRing *ring)
+{
+    if (ring->running) {
+        Handoff_Close(&(ring->wake));
+        (void) pthread_join(ring->thread, NULL);
+        ring->running = false;
+    }
+    Handoff_Destroy(&(ring->wake));
+}
+
+
+/* Any thread: posts a message; never blocks */
+static void Log_VPrintf(LogLevel level, const char *format, va_list args)
+{
+    LogRing *ring = &logRingG;
+
+    if (level < (LogLevel) __atomic_load_n(&(ring->min_level),
+                                           __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* Without a writer, there is nothing better than writing it here */
+    if (!ring->running) {
+        (void) vfprintf(stdout, format, args);
+        return;
+    }
+
+    uint32_t position = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    LogSlot *slot;
+    while (true) {
+        slot = &(ring->slots[position % LOG_RING_SLOTS]);
+        int32_t lag = (int32_t) (__atomic_load_n(&(slot->sequence),
+                                                 __ATOMIC_ACQUIRE) -
+                                 position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&(ring->head), &position,
+                                            position + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (lag < 0) {
+            /* Full: the writer has yet to finish with this slot */
+            __atomic_add_fetch(&(ring->dropped[level]), 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            position = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+        }
+    }
+
+    int length = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    if (length < 0) {
+        length = 0;
+    }
+    else if (length >= (int) sizeof(slot->text)) {
+        length = sizeof(slot->text) - 1;
+    }
+    slot->level = (uint16_t) level;
+    slot->length = (uint16_t) length;
+    __atomic_store_n(&(slot->sequence), position + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&(ring->posted[level]), 1, __ATOMIC_RELAXED);
+
+    Handoff_Post(&(ring->wake));
+}
+
+
+static void Log_Printf(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void Log_Printf(LogLevel level, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    Log_VPrintf(level, format, args);
+    va_end(args);
+}
+
+
+/* Frontend thread: shows the latest warning or error, if it is new */
+static void Log_ShowNotice(LogRing *ring)
+{
+    LogNotice *notice = &(ring->notice);
+    uint32_t sequence = __atomic_load_n(&(notice->sequence), __ATOMIC_ACQUIRE);
+
+    if ((sequence == ring->shown) || (sequence & 1) || !retroEnvironmentG) {
+        return;
+    }
+
+    char text[LOG_MESSAGE_MAX];
+    memcpy(text, notice->text, sizeof(text));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(notice->sequence), __ATOMIC_RELAXED) != sequence) {
+        /* Being rewritten; try again next frame */
+        return;
+    }
+    text[sizeof(text) - 1] = 0;
+    ring->shown = sequence;
+
+    struct retro_message message = { text, LOG_NOTICE_FRAMES };
+    (void) (retroEnvironmentG)(RETRO_ENVIRONMENT_SET_MESSAGE, &message);
+}
+
+
+/* ************************************************************************ */
+/* Worker pool
+/* ************************************************************************ */
+
+/* Threads that help the runner thread convert large textures.  A job splits
+   a range of rows into stripes; the submitting thread and every worker
+   claim stripes until there are none left.  The pool is created once at
+   retro_init() and nothing is allocated per job.
+
+   The submitter waits for every worker to have finished with a job, not
+   just for the last stripe, so that no worker can still be looking at the
+   job when the next one is set up. */
+#define WORKER_POOL_MAX_THREADS 7
+#define WORKER_POOL_MAX_STRIPES 32
+/* Below this many pixels, waking the workers costs more than it saves */
+#define WORKER_POOL_MIN_PIXELS (128 * 1024)
+
+/* Processes rows first up to but not including last, of stripe stripe */
+typedef void (*WorkerFn)(void *arg, unsigned int stripe, uint32_t first,
+                         uint32_t last);
+
+typedef struct WorkerPool
+{
+    pthread_t threads[WORKER_POOL_MAX_THREADS];
+    unsigned int count;
+    /* Posted once per job by the submitter, and once per job by whichever
+       thread finishes with it last */
+    Handoff start, done;
+    /* The current job */
+    WorkerFn fn;
+    void *arg;
+    uint32_t rows, stripes;
+    volatile uint32_t next_stripe;
+    /* Threads still working on the current job */
+    volatile uint32_t participants;
+} WorkerPool;
+
+static WorkerPool workerPoolG;
+
+
+static void WorkerPool_Work(WorkerPool *pool)
+{
+    uint32_t stripe;
+
+    while ((stripe = __atomic_fetch_add(&(pool->next_stripe), 1,
+                                        __ATOMIC_RELAXED)) < pool->stripes) {
+        uint32_t first = (uint32_t)
+            (((uint64_t) stripe * pool->rows) / pool->stripes);
+        uint32_t last = (uint32_t)
+            (((uint64_t) (stripe + 1) * pool->rows) / pool->stripes);
+        (pool->fn)(pool->arg, stripe, first, last);
+    }
+
+    if (!__atomic_sub_fetch(&(pool->participants), 1, __ATOMIC_ACQ_REL)) {
+        Handoff_Post(&(pool->done));
+    }
+}
+
+
+static void *WorkerPool_Main(void *arg)
+{
+    WorkerPool *pool = (WorkerPool *) arg;
+    uint32_t jobs = 0;
+
+    while (Handoff_Wait(&(pool->start), ++jobs)) {
+        WorkerPool_Work(pool);
+    }
+
+    return NULL;
+}
+
+
+/* Starts up to count workers; LIBRETROMAME_CONVERT_THREADS in the
+   environment overrides count */
+static void WorkerPool_Create(WorkerPool *pool, unsigned int count)
+{
+    const char *env = getenv("LIBRETROMAME_CONVERT_THREADS");
+    if (env) {
+        count = (unsigned int) atoi(env);
+    }
+    if (count > WORKER_POOL_MAX_THREADS) {
+        count = WORKER_POOL_MAX_THREADS;
+    }
+
+    Handoff_Initialize(&(pool->start));
+    Handoff_Initialize(&(pool->done));
+    Handoff_Open(&(pool->start));
+    Handoff_Open(&(pool->done));
+
+    pool->count = 0;
+    while (pool->count < count) {
+        if (pthread_create(&(pool->threads[pool->count]), NULL,
+                           &WorkerPool_Main, pool)) {
+            break;
+        }
+        pool->count += 1;
+    }
+}
+
+
+static void WorkerPool_Destroy(WorkerPool *pool)
+{
+    Handoff_Close(&(pool->start));
+    for (unsigned int i = 0; i < pool->count; i++) {
+        (void) pthread_join(pool->threads[i], NULL);
+    }
+    pool->count = 0;
+
+    Handoff_Destroy(&(pool->start));
+    Handoff_Destroy(&(pool->done));
+}
+
+
+/* Runs fn over rows rows, on the calling thread alone if there are no
+   workers or there are fewer than WORKER_POOL_MIN_PIXELS pixels; returns
+   the number of stripes the rows were split into.  Only one thread may
+   submit jobs. */
+static uint32_t WorkerPool_Run(WorkerPool *pool, WorkerFn fn, void *arg,
+                               uint32_t rows, size_t pixels)
+{
+    if (!pool->count || (pixels < WORKER_POOL_MIN_PIXELS) || (rows < 2)) {
+        (fn)(arg, 0, 0, rows);
+        return 1;
+    }
+
+    /* A few stripes per thread, as rows that need no work make some
+       stripes much cheaper than others */
+    uint32_t stripes = 4 * (pool->count + 1);
+    if (stripes > WORKER_POOL_MAX_STRIPES) {
+        stripes = WORKER_POOL_MAX_STRIPES;
+    }
+    if (stripes > rows) {
+        stripes = rows;
+    }
+
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->rows = rows;
+    pool->stripes = stripes;
+    pool->next_stripe = 0;
+    pool->participants = pool->count + 1;
+
+    uint32_t target = Handoff_Sequence(&(pool->done)) + 1;
+    Handoff_Post(&(pool->start));
+    WorkerPool_Work(pool);
+    (void) Handoff_Wait(&(pool->done), target);
+
+    return stripes;
+}
+
+
+/* ************************************************************************ */
+/* Save states
+/* ************************************************************************ */
+
+/* States are made by MAME's own save and load machinery, which works on
+   files; the core points MAME's state directory at a temporary directory
+   (in memory where there is one) and moves states between that file and a
+   buffer allocated once per game.
+
+   Only the runner thread may ask MAME for anything, and MAME only acts on
+   a save or load between frames.  So the frontend thread posts a request
+   as if it were asking for a frame; the runner picks it up where it would
+   otherwise wait for that frame, pauses the game so that MAME carries out
+   the request without emulating any further, and finishes it in the paused
+   callback.  The request stands in for the frame it was posted as, whose
+   picture (if any) is never delivered, which keeps both handoffs counting
+   in step.  The runner stays paused until the next real frame is asked
+   for, so that requests in a row cost no emulation either.
+
+   In pipelined mode the runner is a frame ahead of retro_run(), and so
+   is the state. */
+typedef enum StateOp
+{
+    StateOp_None,
+    StateOp_Save,
+    /* A save that is left in the file, to be loaded again as it is */
+    StateOp_Checkpoint,
+    StateOp_Load
+} StateOp;
+
+typedef struct StateChannel
+{
+    /* Set by the frontend thread, taken by the runner */
+    volatile uint32_t request;
+    /* The frame number of toRunnerG that the request was posted as */
+    volatile uint32_t frame;
+    /* Runner thread only: what MAME has been asked to do, and whether the
+       game is paused for it */
+    StateOp in_flight;
+    bool paused;
+    /* Posted by the runner for each finished request; closed while no game
+       is running */
+    Handoff done;
+    volatile bool ok;
+} StateChannel;
+
+static StateChannel stateChannelG;
+
+/* The temporary file, as MAME names it and as the core opens it */
+#define STATE_FILE_NAME_MAX 64
+static char stateFileNameG[STATE_FILE_NAME_MAX];
+static char statePathG[1024 + STATE_FILE_NAME_MAX];
+
+/* What retro_serialize() writes in front of MAME's state: the magic number
+   and the length of the state */
+#define STATE_MAGIC 0x53524d4c
+#define STATE_HEADER_SIZE 16
+/* Room for MAME's states to grow beyond the first one measured */
+#define STATE_SLACK (64 * 1024)
+
+/* The state buffer, allocated once per game when the size of a state is
+   first needed; stateLengthG is the length of the last state saved */
+static uint8_t *stateDataG;
+static size_t stateCapacityG, stateLengthG;
+
+
+/* Picks the temporary directory and names the state file in it */
+static void State_Configure(LibMame_RunGameOptions *options)
+{
+    const char *directory = getenv("TMPDIR");
+    if (!access("/dev/shm", W_OK)) {
+        directory = "/dev/shm";
+    }
+    else if (!directory) {
+        directory = "/tmp";
+    }
+
+    snprintf(options->state_directory, sizeof(options->state_directory),
+             "%s", directory);
+    snprintf(stateFileNameG, sizeof(stateFileNameG), "libretromame-%d.sta",
+             (int) getpid());
+    snprintf(statePathG, sizeof(statePathG), "%s/%s", directory,
+             stateFileNameG);
+}
+
+
+/* Writes length bytes to the state file, without stdio so that nothing is
+   allocated */
+static bool State_WriteFile(const uint8_t *data, size_t length)
+{
+    int fd = open(statePathG, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    while (length) {
+        ssize_t done = write(fd, data, length);
+        if (done <= 0) {
+            break;
+        }
+        data += done;
+        length -= (size_t) done;
+    }
+
+    return ((close(fd) == 0) && !length);
+}
+
+
+/* Reads the state file into data if it fits in capacity bytes; *length is
+   set to the file's length either way */
+static bool State_ReadFile(uint8_t *data, size_t capacity, size_t *length)
+{
+    int fd = open(statePathG, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) || (st.st_size <= 0)) {
+        (void) close(fd);
+        return false;
+    }
+
+    *length = (size_t) st.st_size;
+    size_t remaining = (*length <= capacity) ? *length : 0;
+    bool ok = (remaining != 0);
+    while (remaining) {
+        ssize_t done = read(fd, data, remaining);
+        if (done <= 0) {
+            ok = false;
+            break;
+        }
+        data += done;
+        remaining -= (size_t) done;
+    }
+
+    (void) close(fd);
+    return ok;
+}
+
+
+/* Runner thread: asks MAME to carry out the request, if there is one;
+   returns true if it did */
+static bool State_Begin(StateChannel *channel)
+{
+    uint32_t op = __atomic_exchange_n(&(channel->request), StateOp_None,
+                                      __ATOMIC_ACQ_REL);
+    if (op == StateOp_None) {
+        return false;
+    }
+
+    if (!channel->paused) {
+        LibMame_RunningGame_Schedule_Pause(runningGameG);
+        channel->paused = true;
+    }
+    if (op != StateOp_Load) {
+        (void) unlink(statePathG);
+        LibMame_RunningGame_SaveState(runningGameG, stateFileNameG);
+    }
+    else {
+        LibMame_RunningGame_LoadState(runningGameG, stateFileNameG);
+    }
+    channel->in_flight = (StateOp) op;
+
+    return true;
+}
+
+
+/* Runner thread, paused: MAME has carried out the request in flight */
+static void State_Finish(StateChannel *channel)
+{
+    if (channel->in_flight == StateOp_None) {
+        return;
+    }
+
+    bool ok = true;
+    if (channel->in_flight == StateOp_Save) {
+        ok = State_ReadFile(stateDataG, stateCapacityG, &stateLengthG);
+    }
+    else if (channel->in_flight == StateOp_Checkpoint) {
+        ok = !access(statePathG, R_OK);
+    }
+    channel->in_flight = StateOp_None;
+    channel->ok = ok;
+
+    /* The request took the place of a frame */
+    while (!Handoff_Reached(Handoff_Sequence(&fromRunnerG),
+                            channel->frame)) {
+        Handoff_Post(&fromRunnerG);
+    }
+    Handoff_Post(&(channel->done));
+}
+
+
+/* Runner thread: waits until frame has been asked for, a request has been
+   posted, or the game is to stop.  A request is posted as the frame after
+   the last one asked for, which right after a load is still short of the
+   frame the runner waits for; so wait for each post in turn, and look at
+   the request after every one of them */
+static void State_AwaitFrame(StateChannel *channel, uint32_t frame)
+{
+    while (true) {
+        uint32_t seen = Handoff_Sequence(&toRunnerG);
+        if (__atomic_load_n(&runningGameStopG, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&(channel->request), __ATOMIC_ACQUIRE) ||
+            Handoff_Reached(seen, frame)) {
+            return;
+        }
+        (void) Handoff_Wait(&toRunnerG, seen + 1);
+    }
+}
+
+
+/* Frontend thread: has the runner carry out op, and waits until it has */
+static bool State_Request(StateChannel *channel, StateOp op)
+{
+    if (runningGameNumberG == -1) {
+        return false;
+    }
+
+    uint32_t target = Handoff_Sequence(&(channel->done)) + 1;
+    channel->frame = Handoff_Sequence(&toRunnerG) + 1;
+    __atomic_store_n(&(channel->request), op, __ATOMIC_RELEASE);
+    Handoff_Post(&toRunnerG);
+
+    return (Handoff_Wait(&(channel->done), target) && channel->ok);
+}
+
+
+/* Frontend thread: allocates the state buffer if it hasn't been yet, sized
+   from a first state that is only measured */
+static bool State_Prepare()
+{
+    if (stateCapacityG) {
+        return true;
+    }
+
+    stateLengthG = 0;
+    (void) State_Request(&stateChannelG, StateOp_Save);
+    if (!stateLengthG) {
+        return false;
+    }
+
+    size_t capacity = (2 * stateLengthG) + STATE_SLACK;
+    stateDataG = (uint8_t *) malloc(capacity);
+    if (!stateDataG) {
+        return false;
+    }
+    stateCapacityG = capacity;
+
+    return true;
+}
+
+
+/* Frontend thread: saves a state into stateDataG */
+static bool State_Save()
+{
+    return (State_Prepare() && State_Request(&stateChannelG, StateOp_Save));
+}
+
+
+/* Frontend thread: loads the state of length bytes at data */
+static bool State_Load(const uint8_t *data, size_t length)
+{
+    return (State_WriteFile(data, length) &&
+            State_Request(&stateChannelG, StateOp_Load));
+}
+
+
+/* Frontend thread: saves a state that only State_Restore() is for; nothing
+   is copied out of MAME's file */
+static bool State_Checkpoint()
+{
+    return State_Request(&stateChannelG, StateOp_Checkpoint);
+}
+
+
+/* Frontend thread: loads the state last saved by State_Checkpoint() */
+static bool State_Restore()
+{
+    return State_Request(&stateChannelG, StateOp_Load);
+}
+
+
+static void State_Free()
+{
+    free(stateDataG);
+    stateDataG = NULL;
+    stateCapacityG = stateLengthG = 0;
+    if (stateFileNameG[0]) {
+        (void) unlink(statePathG);
+    }
+}
+
+
+/* ************************************************************************ */
+/* Rewind ring
+/* ************************************************************************ */
+
+/* The last few seconds of states, for rewinding within the core, kept whole
+   in one circular buffer whose size is the configured memory limit; the
+   oldest states make way for new ones.  MAME compresses its states, so two
+   consecutive ones have few bytes in common, and keeping the differences
+   between them would save next to nothing.  Nothing is allocated after the
+   ring is created. */
+#define REWIND_MAX_RECORDS 4096
+
+typedef struct RewindRecord
+{
+    size_t offset;
+    size_t length;
+} RewindRecord;
+
+typedef struct RewindRing
+{
+    uint8_t *data;
+    size_t capacity;
+    RewindRecord records[REWIND_MAX_RECORDS];
+    /* Index of the oldest record, and the number of records */
+    uint32_t oldest, count;
+} RewindRing;
+
+static RewindRing rewindRingG;
+/* Core options, read at load */
+static bool rewindEnabledG;
+static size_t rewindLimitG;
+static unsigned int rewindIntervalG;
+/* Frames since the last state was pushed */
+static unsigned int rewindFramesG;
+/* The player 1 joypad button held to rewind, which the game doesn't get;
+   -1 while rewinding is off */
+static int rewindButtonG = -1;
+
+
+static bool Rewind_Create(RewindRing *ring, size_t limit,
+                          size_t state_capacity)
+{
+    memset(ring, 0, sizeof(*ring));
+
+    /* There had better be room for a few states */
+    if (limit < (2 * state_capacity)) {
+        return false;
+    }
+
+    ring->data = (uint8_t *) malloc(limit);
+    if (!ring->data) {
+        return false;
+    }
+    ring->capacity = limit;
+
+    return true;
+}
+
+
+static void Rewind_Free(RewindRing *ring)
+{
+    free(ring->data);
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+static inline RewindRecord *Rewind_Record(RewindRing *ring, uint32_t age)
+{
+    return &(ring->records[(ring->oldest + ring->count - 1 - age) %
+                           REWIND_MAX_RECORDS]);
+}
+
+
+static void Rewind_DropOldest(RewindRing *ring)
+{
+    ring->oldest = (ring->oldest + 1) % REWIND_MAX_RECORDS;
+    ring->count -= 1;
+}
+
+
+/* Finds room for a state of need bytes, making way by dropping the oldest
+   states; returns its offset */
+static size_t Rewind_Reserve(RewindRing *ring, size_t need)
+{
+    if (ring->count == REWIND_MAX_RECORDS) {
+        Rewind_DropOldest(ring);
+    }
+
+    /* Just after the newest state, or from the start if there is no room
+       there, in which case the states beyond it are the oldest */
+    size_t offset = 0;
+    if (ring->count) {
+        RewindRecord *newest = Rewind_Record(ring, 0);
+        offset = newest->offset + newest->length;
+        if ((offset + need) > ring->capacity) {
+            while (ring->count &&
+                   (ring->records[ring->oldest].offset >= offset)) {
+                Rewind_DropOldest(ring);
+            }
+            offset = 0;
+        }
+    }
+
+    while (ring->count) {
+        RewindRecord *oldest = &(ring->records[ring->oldest]);
+        if ((oldest->offset >= (offset + need)) ||
+            ((oldest->offset + oldest->length) <= offset)) {
+            break;
+        }
+        Rewind_DropOldest(ring);
+    }
+
+    return offset;
+}
+
+
+/* Makes state, of length bytes, the newest one */
+static void Rewind_Push(RewindRing *ring, const uint8_t *state, size_t length)
+{
+    if (!ring->data || (length > ring->capacity)) {
+        return;
+    }
+
+    size_t offset = Rewind_Reserve(ring, length);
+    RewindRecord *record =
+        &(ring->records[(ring->oldest + ring->count) % REWIND_MAX_RECORDS]);
+    record->offset = offset;
+    record->length = length;
+    memcpy(ring->data + offset, state, length);
+    ring->count += 1;
+}
+
+
+/* Steps back from the newest state to the one before it, if there is one;
+   returns the state that is now the newest, or NULL if there is none */
+static const RewindRecord *Rewind_Pop(RewindRing *ring)
+{
+    if (!ring->count) {
+        return NULL;
+    }
+
+    if (ring->count > 1) {
+        ring->count -= 1;
+    }
+
+    return Rewind_Record(ring, 0);
+}
+
+
+/* Frontend thread: pushes the current state */
+static void Rewind_Capture(RewindRing *ring)
+{
+    if (!State_Save()) {
+        return;
+    }
+    if (!ring->data &&
+        !Rewind_Create(ring, rewindLimitG, stateCapacityG)) {
+        /* Not enough memory for it; don't keep trying */
+        rewindEnabledG = false;
+        return;
+    }
+
+    Rewind_Push(ring, stateDataG, stateLengthG);
+}
+
+
+/* Frontend thread: goes back to the next older state, or stays at the
+   oldest one */
+static void Rewind_Step(RewindRing *ring)
+{
+    const RewindRecord *record = Rewind_Pop(ring);
+
+    if (record) {
+        (void) State_Load(ring->data + record->offset, record->length);
+    }
+}
+
+
+/* ************************************************************************ */
+/* Runner thread
+/* ************************************************************************ */
+
+/* The thread that runs MAME.  It is created the first time a game loads
+   and lives until retro_deinit(); between games it is parked on a
+   condition variable, so switching games costs no thread creation and
+   leaves nothing behind.
+
+   Runner_Start() hands it a game and returns at once.  Runner_Stop() asks
+   the game to exit and waits until the thread is parked again.
+   Runner_Join() ends the thread for good.  The CPU and scheduling policy
+   are applied as each game starts, so changing them takes effect on the
+   next load. */
+
+/* Set explicitly so that MAME's stack doesn't depend on the stack limit
+   the frontend happened to be started with */
+#define RUNNER_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct Runner
+{
+    pthread_t thread;
+    bool created;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* Number of games requested, and number finished, so far */
+    uint32_t started, finished;
+    bool quit;
+#ifdef __linux__
+    /* The thread's CPUs as created, restored when it is unpinned */
+    cpu_set_t cpus;
+#endif
+} Runner;
+
+static Runner runnerG =
+{
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+/* Whether to ask for real time scheduling for the runner thread */
+static bool runnerRealtimeG;
+
+
+/* Applies runnerCpuG and runnerRealtimeG to the runner thread itself */
+static void Runner_Place(Runner *runner)
+{
+#ifdef __linux__
+    if (runnerCpuG >= 0) {
+        PinCurrentThread(runnerCpuG);
+    }
+    else {
+        (void) pthread_setaffinity_np(pthread_self(), sizeof(runner->cpus),
+                                      &(runner->cpus));
+    }
+#else
+    (void) runner;
+    PinCurrentThread(runnerCpuG);
+#endif
+
+    /* Real time scheduling usually needs privileges; without them the
+       thread just stays as it is */
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (runnerRealtimeG) {
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+        (void) pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    else {
+        (void) pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    }
+}
+
+
+/* Runs the game in runningGameNumberG to completion */
+static void Runner_RunGame()
+{
+    if (runningGameNumberG != -1) {
+        LibMame_RunGameStatus status = LibMame_RunGame
+            (runningGameNumberG, true, &runGameOptionsG,
+             &runGameCallbacksG, NULL);
+        switch (status) {
+        case LibMame_RunGameStatus_Success:
+            break;
+        case LibMame_RunGameStatus_InvalidGameNum:
+            Log_Printf(LogLevel_Error, "Invalid game\n");
+            break;
+        case LibMame_RunGameStatus_FailedValidityCheck:
+            Log_Printf(LogLevel_Error, "Failed validity check\n");
+            break;
+        case LibMame_RunGameStatus_MissingFiles:
+            Log_Printf(LogLevel_Error, "Missing files\n");
+            break;
+        case LibMame_RunGameStatus_NoSuchGame:
+            Log_Printf(LogLevel_Error, "No such game\n");
+            break;
+        case LibMame_RunGameStatus_InvalidConfig:
+            Log_Printf(LogLevel_Error, "Invalid config\n");
+            break;
+        case LibMame_RunGameStatus_GeneralError:
+            Log_Printf(LogLevel_Error, "General error\n");
+        }
+    }
+
+    runningGameNumberG = -1;
+
+    stateChannelG.in_flight = StateOp_None;
+    stateChannelG.paused = false;
+    Handoff_Close(&(stateChannelG.done));
+    Handoff_Close(&fromRunnerG);
+}
+
+
+static void *Runner_Main(void *arg)
+{
+    Runner *runner = (Runner *) arg;
+
+    pthread_mutex_lock(&(runner->mutex));
+    while (true) {
+        while (!runner->quit && (runner->finished == runner->started)) {
+            pthread_cond_wait(&(runner->cond), &(runner->mutex));
+        }
+        if (runner->quit) {
+            break;
+        }
+        pthread_mutex_unlock(&(runner->mutex));
+
+        Runner_Place(runner);
+        Runner_RunGame();
+
+        pthread_mutex_lock(&(runner->mutex));
+        runner->finished += 1;
+        pthread_cond_broadcast(&(runner->cond));
+    }
+    pthread_mutex_unlock(&(runner->mutex));
+
+    return NULL;
+}
+
+
+/* Creates the thread if need be and starts it on the current game; returns
+   false if there is no thread to run it */
+static bool Runner_Start(Runner *runner)
+{
+    if (!runner->created) {
+        pthread_attr_t attr;
+        if (pthread_attr_init(&attr)) {
+            return false;
+        }
+        (void) pthread_attr_setstacksize(&attr, RUNNER_STACK_SIZE);
+        runner->quit = false;
+        runner->created = !pthread_create(&(runner->thread), &attr,
+                                          &Runner_Main, runner);
+        (void) pthread_attr_destroy(&attr);
+        if (!runner->created) {
+            return false;
+        }
+#ifdef __linux__
+        CPU_ZERO(&(runner->cpus));
+        if (pthread_getaffinity_np(runner->thread, sizeof(runner->cpus),
+                                   &(runner->cpus))) {
+            for (int i = 0; i < CPU_SETSIZE; i++) {
+                CPU_SET(i, &(runner->cpus));
+            }
+        }
+#endif
+    }
+
+    pthread_mutex_lock(&(runner->mutex));
+    runner->started += 1;
+    pthread_cond_broadcast(&(runner->cond));
+    pthread_mutex_unlock(&(runner->mutex));
+
+    return true;
+}
+
+
+/* Asks the current game, if any, to exit, and waits until it has */
+static void Runner_Stop(Runner *runner)
+{
+    __atomic_store_n(&runningGameStopG, true, __ATOMIC_SEQ_CST);
+    Handoff_Post(&toRunnerG);
+
+    pthread_mutex_lock(&(runner->mutex));
+    while (runner->finished != runner->started) {
+        pthread_cond_wait(&(runner->cond), &(runner->mutex));
+    }
+    pthread_mutex_unlock(&(runner->mutex));
+}
+
+
+/* Stops the current game and ends the thread */
+static void Runner_Join(Runner *runner)
+{
+    if (!runner->created) {
+        return;
+    }
+
+    Runner_Stop(runner);
+
+    pthread_mutex_lock(&(runner->mutex));
+    runner->quit = true;
+    pthread_cond_broadcast(&(runner->cond));
+    pthread_mutex_unlock(&(runner->mutex));
+
+    (void) pthread_join(runner->thread, NULL);
+    runner->created = false;
+}
+
+
+/* ************************************************************************ */
+/* Compositor
+/* ************************************************************************ */
+
+/* Games with more than one screen have every screen quad placed into one
+   frame according to the quads' bounds, scaled so that the screen with the
+   most detail is drawn at its native size.  Where that leaves a screen a
+   different size from its texture, its rows are converted into scratch and
+   stretched with the scale kernels.  The placement is only worked out again
+   when the screens' geometry changes. */
+#define COMPOSITOR_MAX_SCREENS 8
+#define COMPOSITOR_MAX_DIMENSION 4096
+
+typedef struct CompositorScreen
+{
+    /* The geometry that the layout was computed from */
+    LibMame_RenderBounds bounds;
+    uint32_t texture_width, texture_height;
+    LibMame_TextureFormat format;
+    /* Where the screen goes in the frame */
+    uint32_t x, y, width, height;
+    /* Source row of each destination row, and source column of each
+       destination column or NULL if the screen is not stretched
+       horizontally */
+    uint32_t *row_map, *column_map;
+} CompositorScreen;
+
+typedef struct Compositor
+{
+    unsigned int count;
+    CompositorScreen screens[COMPOSITOR_MAX_SCREENS];
+    uint32_t width, height;
+    /* Incremented with every new layout, so that frame arena buffers
+       holding an older one are recognized */
+    uint64_t layout;
+    /* Single allocation holding every screen's maps */
+    uint32_t *maps;
+    /* One row of scratch per worker pool stripe, for stretched screens */
+    uint8_t *scratch;
+    size_t scratch_pitch;
+    /* What was last drawn for each screen into each arena buffer */
+    FrameKey drawn[FRAME_ARENA_BUFFERS][COMPOSITOR_MAX_SCREENS];
+} Compositor;
+
+static Compositor compositorG;
+
+
+/* Makes the layout match the given screen quads; returns false if it could
+   not be allocated */
+static bool Compositor_Layout(Compositor *c,
+                              const LibMame_RenderPrimitive **prims,
+                              unsigned int count)
+{
+    bool same = (c->maps && (count == c->count));
+    for (unsigned int i = 0; same && (i < count); i++) {
+        const CompositorScreen *screen = &(c->screens[i]);
+        same = (!memcmp(&(prims[i]->bounds), &(screen->bounds),
+                        sizeof(screen->bounds)) &&
+                (prims[i]->texture.width == screen->texture_width) &&
+                (prims[i]->texture.height == screen->texture_height) &&
+                (LIBMAME_RENDERFLAGS_TEXTURE_FORMAT(prims[i]->flags) ==
+                 screen->format));
+    }
+    if (same) {
+        return true;
+    }
+
+    /* The bounding box of all screens, and the scale that gives the most
+       detailed one a pixel per texel */
+    float x0 = prims[0]->bounds.x0, y0 = prims[0]->bounds.y0;
+    float x1 = prims[0]->bounds.x1, y1 = prims[0]->bounds.y1;
+    float scale = 0;
+    uint32_t max_texture_width = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        const LibMame_RenderBounds *b = &(prims[i]->bounds);
+        x0 = (b->x0 < x0) ? b->x0 : x0;
+        y0 = (b->y0 < y0) ? b->y0 : y0;
+        x1 = (b->x1 > x1) ? b->x1 : x1;
+        y1 = (b->y1 > y1) ? b->y1 : y1;
+        if ((b->x1 > b->x0) && (b->y1 > b->y0)) {
+            float sx = prims[i]->texture.width / (b->x1 - b->x0);
+            float sy = prims[i]->texture.height / (b->y1 - b->y0);
+            scale = (sx > scale) ? sx : scale;
+            scale = (sy > scale) ? sy : scale;
+        }
+        if (prims[i]->texture.width > max_texture_width) {
+            max_texture_width = prims[i]->texture.width;
+        }
+    }
+    if ((scale * (x1 - x0)) > COMPOSITOR_MAX_DIMENSION) {
+        scale = COMPOSITOR_MAX_DIMENSION / (x1 - x0);
+    }
+    if ((scale * (y1 - y0)) > COMPOSITOR_MAX_DIMENSION) {
+        scale = COMPOSITOR_MAX_DIMENSION / (y1 - y0);
+    }
+
+    c->count = 0;
+    c->width = (uint32_t) ((scale * (x1 - x0)) + 0.5f);
+    c->height = (uint32_t) ((scale * (y1 - y0)) + 0.5f);
+    if (!c->width || !c->height) {
+        return false;
+    }
+
+    /* Place each screen, and size its maps */
+    size_t entries = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        const LibMame_RenderBounds *b = &(prims[i]->bounds);
+        CompositorScreen *screen = &(c->screens[i]);
+        screen->bounds = *b;
+        screen->texture_width = prims[i]->texture.width;
+        screen->texture_height = prims[i]->texture.height;
+        screen->format = LIBMAME_RENDERFLAGS_TEXTURE_FORMAT(prims[i]->flags);
+        screen->x = (uint32_t) ((scale * (b->x0 - x0)) + 0.5f);
+        screen->y = (uint32_t) ((scale * (b->y0 - y0)) + 0.5f);
+        uint32_t right = (uint32_t) ((scale * (b->x1 - x0)) + 0.5f);
+        uint32_t bottom = (uint32_t) ((scale * (b->y1 - y0)) + 0.5f);
+        right = (right > c->width) ? c->width : right;
+        bottom = (bottom > c->height) ? c->height : bottom;
+        screen->width = (right > screen->x) ? (right - screen->x) : 0;
+        screen->height = (bottom > screen->y) ? (bottom - screen->y) : 0;
+        entries += screen->width + screen->height;
+    }
+
+    free(c->maps);
+    free(c->scratch);
+    c->maps = (uint32_t *) malloc((entries + 1) * sizeof(uint32_t));
+    c->scratch_pitch = FRAME_ARENA_ALIGN_UP(max_texture_width * 4) +
+        FRAME_ARENA_ALIGN;
+    if (posix_memalign((void **) &(c->scratch), FRAME_ARENA_ALIGN,
+                       WORKER_POOL_MAX_STRIPES * c->scratch_pitch)) {
+        c->scratch = NULL;
+    }
+    if (!c->maps || !c->scratch) {
+        free(c->maps);
+        free(c->scratch);
+        c->maps = NULL;
+        c->scratch = NULL;
+        return false;
+    }
+
+    /* Nearest texel to the centre of each destination pixel */
+    uint32_t *map = c->maps;
+    for (unsigned int i = 0; i < count; i++) {
+        CompositorScreen *screen = &(c->screens[i]);
+        screen->row_map = map;
+        for (uint32_t y = 0; y < screen->height; y++) {
+            *map++ = (uint32_t) (((2 * (uint64_t) y + 1) *
+                                  screen->texture_height) /
+                                 (2 * (uint64_t) screen->height));
+        }
+        if (screen->width == screen->texture_width) {
+            screen->column_map = NULL;
+            continue;
+        }
+        screen->column_map = map;
+        for (uint32_t x = 0; x < screen->width; x++) {
+            *map++ = (uint32_t) (((2 * (uint64_t) x + 1) *
+                                  screen->texture_width) /
+                                 (2 * (uint64_t) screen->width));
+        }
+    }
+
+    c->count = count;
+    c->layout += 1;
+
+    return true;
+}
+
+
+static void Compositor_Free(Compositor *c)
+{
+    free(c->maps);
+    free(c->scratch);
+    /* The layout number carries on, so that no arena buffer can ever match
+       a layout that it was not drawn with */
+    uint64_t layout = c->layout;
+    memset(c, 0, sizeof(*c));
+    c->layout = layout;
+}
+
+
+/* ************************************************************************ */
+/* Vector screens
+/* ************************************************************************ */
+
+/* Vector games draw with line primitives instead of a screen texture.  The
+   lines are drawn in software, vectorScreenG.scale times the game's native
+   resolution, into a frame of accumulated light: each pixel gets each
+   line's colour, weighted by the line's intensity and by how much of the
+   pixel the beam covers, and lines add up as a beam's light would.  The
+   frame is then resolved into the output pixel format, clearing it for the
+   next frame as it goes.
+
+   The frame is split into bands of rows across the worker pool.  Each band
+   draws the part of every line that crosses it, so no two threads ever
+   touch the same pixel.  Bands are drawn VECTOR_BAND_ROWS rows at a time,
+   which keeps the rows being drawn into in the cache while every line
+   crossing them is drawn, and while they are resolved: at the higher
+   scales the whole frame of accumulated light is far bigger than the
+   cache, and lines drawn across it one after another would miss on almost
+   every row. */
+#define VECTOR_SCALE_MAX 4
+#define VECTOR_BAND_ROWS 16
+
+typedef struct VectorLine
+{
+    VectorSpan span;
+    /* The rows of pixel centres that the line can reach */
+    float top, bottom;
+} VectorLine;
+
+typedef struct VectorScreen
+{
+    /* Zero unless the running game has a vector screen */
+    uint32_t scale;
+    /* The size of the render target that the lines are placed in, and of
+       the frame they are drawn into */
+    uint32_t target_width, target_height;
+    uint32_t width, height;
+    /* Four 16 bit channels per pixel, and four pixels more per row for the
+       SIMD span kernels to run on into; pitch is in channels */
+    uint16_t *accum;
+    size_t accum_pitch;
+    /* The lines of the frame being drawn */
+    VectorLine *lines;
+    uint32_t count, capacity;
+} VectorScreen;
+
+static VectorScreen vectorScreenG;
+
+/* A frame of lines being drawn, shared with the worker pool */
+typedef struct VectorJob
+{
+    const VectorScreen *screen;
+    ResolveRowFn resolve;
+    uint8_t *frame;
+    size_t pitch;
+} VectorJob;
+
+
+/* Sets up for a game's vector screen, of the given native size; nothing is
+   allocated until the first frame is drawn */
+static void Vector_Configure(VectorScreen *v, uint32_t width, uint32_t height,
+                             uint32_t scale)
+{
+    v->scale = (scale < 1) ? 1 : (scale > VECTOR_SCALE_MAX) ?
+        VECTOR_SCALE_MAX : scale;
+    while ((v->scale > 1) &&
+           (((width * v->scale) > COMPOSITOR_MAX_DIMENSION) ||
+            ((height * v->scale) > COMPOSITOR_MAX_DIMENSION))) {
+        v->scale -= 1;
+    }
+    v->target_width = width;
+    v->target_height = height;
+    v->width = width * v->scale;
+    v->height = height * v->scale;
+}
+
+
+/* Allocates the accumulated light, cleared; returns false on failure */
+static bool Vector_Reserve(VectorScreen *v)
+{
+    if (v->accum) {
+        return true;
+    }
+
+    v->accum_pitch = FRAME_ARENA_ALIGN_UP
+        ((v->width + 4) * 4 * sizeof(uint16_t)) / sizeof(uint16_t);
+    size_t size = v->accum_pitch * v->height * sizeof(uint16_t);
+    if (posix_memalign((void **) &(v->accum), FRAME_ARENA_ALIGN, size)) {
+        v->accum = NULL;
+        return false;
+    }
+    memset(v->accum, 0, size);
+
+    return true;
+}
+
+
+/* Collects the line primitives of a frame, in frame pixels; returns false
+   if they could not all be kept */
+static bool Vector_Collect(VectorScreen *v,
+                           const LibMame_RenderPrimitive *render_primitive_list)
+{
+    float sx = (float) v->width / v->target_width;
+    float sy = (float) v->height / v->target_height;
+
+    v->count = 0;
+    for (const LibMame_RenderPrimitive *prim = render_primitive_list; prim;
+         prim = prim->next) {
+        if (prim->type != LibMame_RenderPrimitiveType_Line) {
+            continue;
+        }
+        if (v->count == v->capacity) {
+            uint32_t capacity = v->capacity ? (2 * v->capacity) : 1024;
+            VectorLine *lines = (VectorLine *) realloc
+                (v->lines, capacity * sizeof(VectorLine));
+            if (!lines) {
+                return false;
+            }
+            v->lines = lines;
+            v->capacity = capacity;
+        }
+
+        /* Lines thinner than a pixel light less of it; wider ones light
+           their whole width fully, and fade out over one more pixel */
+        float width = prim->width * sx;
+        float weight = (width < 1) ? width : 1;
+        float intensity = prim->color.a * weight * 255;
+        if (intensity <= 0) {
+            continue;
+        }
+
+        VectorLine *line = &(v->lines[v->count++]);
+        VectorSpan *span = &(line->span);
+        span->ax = prim->bounds.x0 * sx;
+        span->ay = prim->bounds.y0 * sy;
+        span->dx = (prim->bounds.x1 * sx) - span->ax;
+        span->dy = (prim->bounds.y1 * sy) - span->ay;
+        float length2 = (span->dx * span->dx) + (span->dy * span->dy);
+        span->inverse_length2 = (length2 > 0) ? (1 / length2) : 0;
+        span->inverse_dy = (fabsf(span->dy) > 1e-6f) ? (1 / span->dy) : 0;
+        span->reach = (((width > 1) ? width : 1) / 2) + 0.5f;
+        const float channels[3] = { prim->color.b, prim->color.g,
+                                    prim->color.r };
+        for (int c = 0; c < 3; c++) {
+            float value = channels[c] * intensity;
+            span->color[c] = (uint16_t) ((value < 0) ? 0 :
+                                         (value > 255) ? 255 : value);
+        }
+        span->color[3] = 0;
+        float y0 = span->ay, y1 = span->ay + span->dy;
+        line->top = ((y0 < y1) ? y0 : y1) - span->reach;
+        line->bottom = ((y0 > y1) ? y0 : y1) + span->reach;
+    }
+
+    return (v->count > 0);
+}
+
+
+/* Draws the lines into rows first to last, and resolves those rows into the
+   frame */
+static void Vector_DrawBand(const VectorJob *job, uint32_t first,
+                            uint32_t last)
+{
+    const VectorScreen *v = job->screen;
+    VectorSpanFn draw = convertKernelsG.vector_span;
+
+    for (uint32_t i = 0; i < v->count; i++) {
+        const VectorLine *line = &(v->lines[i]);
+        const VectorSpan *span = &(line->span);
+        /* Rows whose pixel centres (at y + 0.5) are within reach */
+        float top = line->top - 0.5f, bottom = line->bottom - 0.5f;
+        if ((bottom < first) || (top >= last)) {
+            continue;
+        }
+        uint32_t y = (top > first) ? (uint32_t) ceilf(top) : first;
+        uint32_t end = (bottom < last) ? ((uint32_t) bottom + 1) : last;
+        end = (end > last) ? last : end;
+
+        for (; y < end; y++) {
+            /* The columns within reach of the part of the line that is
+               within reach of this row */
+            float cy = y + 0.5f;
+            float t0 = 0, t1 = 1;
+            if (span->inverse_dy != 0) {
+                t0 = (cy - span->reach - span->ay) * span->inverse_dy;
+                t1 = (cy + span->reach - span->ay) * span->inverse_dy;
+                t0 = (t0 < 0) ? 0 : (t0 > 1) ? 1 : t0;
+                t1 = (t1 < 0) ? 0 : (t1 > 1) ? 1 : t1;
+            }
+            float xa = span->ax + (t0 * span->dx);
+            float xb = span->ax + (t1 * span->dx);
+            float left = ((xa < xb) ? xa : xb) - span->reach - 0.5f;
+            float right = ((xa > xb) ? xa : xb) + span->reach - 0.5f;
+            if ((right < 0) || (left >= v->width)) {
+                continue;
+            }
+            uint32_t x = (left > 0) ? (uint32_t) ceilf(left) : 0;
+            uint32_t x_end = (right < v->width) ? ((uint32_t) right + 1) :
+                v->width;
+            if (x_end > x) {
+                (draw)(v->accum + (y * v->accum_pitch) + (4 * x), x_end - x,
+                       x + 0.5f, cy, span);
+            }
+        }
+    }
+
+    uint8_t *dest = job->frame + (first * job->pitch);
+    for (uint32_t y = first; y < last; y++) {
+        (job->resolve)(dest, v->accum + (y * v->accum_pitch), v->width);
+        dest += job->pitch;
+    }
+}
+
+
+static void Vector_DrawRows(void *arg, unsigned int stripe, uint32_t first,
+                            uint32_t last)
+{
+    (void) stripe;
+
+    while (first < last) {
+        uint32_t end = ((last - first) > VECTOR_BAND_ROWS) ?
+            (first + VECTOR_BAND_ROWS) : last;
+        Vector_DrawBand((const VectorJob *) arg, first, end);
+        first = end;
+    }
+}
+
+
+static void Vector_Free(VectorScreen *v)
+{
+    free(v->accum);
+    free(v->lines);
+    memset(v, 0, sizeof(*v));
+}
+
+
+/* ************************************************************************ */
+/* Audio ring
+/* ************************************************************************ */
+
+/* Samples travel from UpdateAudioCb() on the runner thread to retro_run()
+   through a single-producer, single-consumer ring of interleaved stereo
+   frames.  Neither side ever waits for the other: when the ring is full the
+   newest samples are dropped, and whatever the frontend does not accept
+   stays in the ring for the next retro_run().  head and tail are
+   free-running frame counts, written only by the producer and the consumer
+   respectively. */
+#define AUDIO_RING_FRAMES (16 * 1024)
+
+typedef struct AudioRingStats
+{
+    /* Frames accepted by the frontend */
+    uint64_t delivered;
+    /* Frames dropped because the ring was full; counted by the producer */
+    volatile uint64_t dropped;
+    /* Drains where the frontend took only part of what it was offered */
+    uint64_t partial_writes;
+    /* Drains that found the ring empty once the game had produced sound */
+    uint64_t empty_drains;
+    /* Frames left in the ring after each drain */
+    uint64_t fill_sum, fill_count;
+    uint32_t fill_min, fill_max;
+} AudioRingStats;
+
+typedef struct AudioRing
+{
+    int16_t samples[2 * AUDIO_RING_FRAMES];
+    volatile uint32_t head, tail;
+    AudioRingStats stats;
+} AudioRing;
+
+static AudioRing audioRingG;
+
+/* The master volume as a Q15 gain; at AUDIO_GAIN_UNITY (0 dB) samples are
+   copied untouched */
+#define AUDIO_GAIN_UNITY 32768
+static int32_t masterGainG = AUDIO_GAIN_UNITY;
+
+/* Q15 gains for 0 to 32 dB of attenuation, the range that MAME uses */
+#define AUDIO_MAX_ATTENUATION 32
+static const uint16_t attenuationGainsG[AUDIO_MAX_ATTENUATION + 1] =
+{
+    32768, 29205, 26029, 23198, 20675, 18427, 16423, 14637, 13045, 11627,
+    10362, 9235, 8231, 7336, 6538, 5827, 5193, 4629, 4125, 3677, 3277, 2920,
+    2603, 2320, 2068, 1843, 1642, 1464, 1305, 1163, 1036, 924, 823
+};
+
+
+/* Only called while the runner thread is not running */
+static void AudioRing_Reset(AudioRing *ring)
+{
+    ring->head = ring->tail = 0;
+}
+
+
+static void AudioRing_ResetStats(AudioRing *ring)
+{
+    memset(&(ring->stats), 0, sizeof(ring->stats));
+    ring->stats.fill_min = UINT32_MAX;
+}
+
+
+/* Copies frames stereo frames, applying gain unless it is unity */
+static void AudioRing_Copy(int16_t *dest, const int16_t *src,
+                           uint32_t frames, int32_t gain)
+{
+    if (gain == AUDIO_GAIN_UNITY) {
+        memcpy(dest, src, frames * 2 * sizeof(int16_t));
+    }
+    else {
+        (convertKernelsG.gain)(dest, src, 2 * (size_t) frames,
+                               (int16_t) gain);
+    }
+}
+
+
+/* Producer side: appends frames frames of samples, scaled by gain, or as
+   many as fit */
+static void AudioRing_Write(AudioRing *ring, const int16_t *samples,
+                            uint32_t frames, int32_t gain)
+{
+    uint32_t head = ring->head;
+    uint32_t space = AUDIO_RING_FRAMES -
+        (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE));
+
+    if (frames > space) {
+        __atomic_add_fetch(&(ring->stats.dropped), frames - space,
+                           __ATOMIC_RELAXED);
+        frames = space;
+    }
+
+    uint32_t offset = head % AUDIO_RING_FRAMES;
+    uint32_t first = AUDIO_RING_FRAMES - offset;
+    first = (frames < first) ? frames : first;
+    AudioRing_Copy(&(ring->samples[2 * offset]), samples, first, gain);
+    AudioRing_Copy(ring->samples, &(samples[2 * first]), frames - first,
+                   gain);
+
+    __atomic_store_n(&(ring->head), head + frames, __ATOMIC_RELEASE);
+}
+
+
+/* Consumer side: returns the number of frames that can be read */
+static uint32_t AudioRing_Fill(const AudioRing *ring)
+{
+    return __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+
+/* Consumer side: points samples at the oldest frames, and returns how many
+   of the fill frames are contiguous there */
+static uint32_t AudioRing_Peek(const AudioRing *ring, uint32_t fill,
+                               const int16_t **samples)
+{
+    uint32_t offset = ring->tail % AUDIO_RING_FRAMES;
+    uint32_t contiguous = AUDIO_RING_FRAMES - offset;
+
+    *samples = &(ring->samples[2 * offset]);
+
+    return (fill < contiguous) ? fill : contiguous;
+}
+
+
+/* Consumer side: releases frames frames back to the producer */
+static void AudioRing_Consume(AudioRing *ring, uint32_t frames)
+{
+    __atomic_store_n(&(ring->tail), ring->tail + frames, __ATOMIC_RELEASE);
+}
+
+
+/* ************************************************************************ */
+/* Export
+/* ************************************************************************ */
+
+/* Optionally, every frame of video and block of audio is also published in
+   a POSIX shared memory object, for an encoder in another process to pick
+   up without having to capture the frontend's window.  The object starts
+   with an ExportHeader, and while exporting, the frame arena's buffers are
+   allocated in the object as well: a frame is published by saying where
+   in the object it already is, and the encoder reads its pixels in place.
+   Audio blocks are small, and MAME's buffers don't outlive the callback,
+   so they are copied into the header.
+
+   Nothing ever waits for the encoder.  Frames and audio blocks go into the
+   next of a small ring of slots each, which a slow encoder finds written
+   over.  Item n (counting from zero) goes into slot n modulo the number of
+   slots, whose sequence number is odd while it is being written and is
+   2n + 2 once it holds item n.  The runner draws into each arena buffer
+   again FRAME_ARENA_BUFFERS frames later; a buffer's generation count is
+   odd while it is being drawn into, and a frame is only good while its
+   buffer's generation is still the one in its slot.  So an encoder reads
+   a slot's sequence number, the slot, then the pixels or samples, and then
+   the sequence number and generation again, dropping the item if either
+   has moved on.
+
+   Growing the frame arena grows the object, and object_size says how much
+   of it to map. */
+#define EXPORT_MAGIC 0x5850524c
+#define EXPORT_VERSION 1
+#define EXPORT_FRAME_SLOTS 8
+#define EXPORT_AUDIO_SLOTS 16
+#define EXPORT_AUDIO_MAX_FRAMES 4096
+/* The arena has at most two allocations at a time: its buffers, and those
+   it had before it last grew */
+#define EXPORT_MAX_REGIONS 4
+
+typedef struct ExportFrame
+{
+    volatile uint32_t sequence;
+    /* The frame number, as the runner counts frames */
+    uint32_t frame;
+    /* CLOCK_MONOTONIC */
+    uint64_t timestamp_ns;
+    /* Where the pixels are, from the start of the object */
+    uint64_t offset;
+    uint32_t width, height, pitch;
+    /* A retro_pixel_format */
+    uint32_t format;
+    /* The arena buffer holding the pixels, and its generation */
+    uint32_t buffer, generation;
+} ExportFrame;
+
+typedef struct ExportAudio
+{
+    volatile uint32_t sequence;
+    /* The frame that the samples were made with */
+    uint32_t frame;
+    uint64_t timestamp_ns;
+    uint32_t sample_rate;
+    /* Stereo frames in samples */
+    uint32_t frames;
+    int16_t samples[2 * EXPORT_AUDIO_MAX_FRAMES];
+} ExportAudio;
+
+typedef struct ExportHeader
+{
+    uint32_t magic, version;
+    /* sizeof(ExportHeader), to catch layout changes */
+    uint32_t header_size;
+    uint32_t frame_slots, audio_slots, buffers;
+    /* The process exporting to the object */
+    int32_t owner;
+    volatile uint64_t object_size;
+    /* The number of frames and audio blocks published so far */
+    volatile uint32_t frames_published, audio_published;
+    volatile uint32_t generations[FRAME_ARENA_BUFFERS];
+    ExportFrame frames[EXPORT_FRAME_SLOTS];
+    ExportAudio audio[EXPORT_AUDIO_SLOTS];
+} ExportHeader;
+
+typedef struct ExportRegion
+{
+    uint8_t *base;
+    size_t offset, size;
+} ExportRegion;
+
+typedef struct Export
+{
+    /* Mapped while exporting, NULL otherwise */
+    ExportHeader *header;
+    int fd;
+    char name[64];
+    size_t object_size;
+    ExportRegion regions[EXPORT_MAX_REGIONS];
+} Export;
+
+static Export exportG;
+
+
+static uint64_t Export_Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ull) + (uint64_t) ts.tv_nsec;
+}
+
+
+static inline size_t Export_PageAlign(size_t n)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (n + (page - 1)) & ~(page - 1);
+}
+
+
+/* Unlinks the object called name if the process that exported to it is no
+   longer running; returns whether it did */
+static bool Export_RemoveLeftover(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    int32_t owner = 0;
+    struct stat st;
+    if (!fstat(fd, &st) && ((size_t) st.st_size >= sizeof(ExportHeader))) {
+        void *header = mmap(NULL, sizeof(ExportHeader), PROT_READ,
+                            MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED) {
+            if (((const ExportHeader *) header)->magic == EXPORT_MAGIC) {
+                owner = ((const ExportHeader *) header)->owner;
+            }
+            (void) munmap(header, sizeof(ExportHeader));
+        }
+    }
+    (void) close(fd);
+
+    /* Any other object might be in use */
+    if ((owner <= 0) || !kill((pid_t) owner, 0) || (errno != ESRCH)) {
+        return false;
+    }
+
+    return !shm_unlink(name);
+}
+
+
+/* Creates the shared memory object; returns false if it could not be */
+static bool Export_Open(Export *e, const char *name)
+{
+    memset(e, 0, sizeof(*e));
+    e->fd = -1;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+
+    /* An object of the same name can only be replaced if it was left over
+       by an instance that didn't get to clean up */
+    e->fd = shm_open(e->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if ((e->fd < 0) && (errno == EEXIST)) {
+        if (!Export_RemoveLeftover(e->name)) {
+            Log_Printf(LogLevel_Error, "%s is in use\n", e->name);
+            return false;
+        }
+        e->fd = shm_open(e->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (e->fd < 0) {
+        return false;
+    }
+
+    size_t size = Export_PageAlign(sizeof(ExportHeader));
+    void *header = MAP_FAILED;
+    if (!ftruncate(e->fd, (off_t) size)) {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd,
+                      0);
+    }
+    if (header == MAP_FAILED) {
+        (void) close(e->fd);
+        (void) shm_unlink(e->name);
+        e->fd = -1;
+        return false;
+    }
+
+    e->header = (ExportHeader *) header;
+    e->object_size = size;
+    e->header->version = EXPORT_VERSION;
+    e->header->header_size = sizeof(ExportHeader);
+    e->header->frame_slots = EXPORT_FRAME_SLOTS;
+    e->header->audio_slots = EXPORT_AUDIO_SLOTS;
+    e->header->buffers = FRAME_ARENA_BUFFERS;
+    e->header->owner = (int32_t) getpid();
+    e->header->object_size = size;
+    /* Last, so that a header with the magic number is complete */
+    __atomic_store_n(&(e->header->magic), EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/* Only called once the frame arena has released its regions */
+static void Export_Close(Export *e)
+{
+    if (!e->header) {
+        return;
+    }
+
+    (void) munmap(e->header, Export_PageAlign(sizeof(ExportHeader)));
+    (void) close(e->fd);
+    (void) shm_unlink(e->name);
+    memset(e, 0, sizeof(*e));
+    e->fd = -1;
+}
+
+
+/* Frame arena: allocates size bytes at the end of the object, page aligned
+   and so aligned for the arena too */
+static void *Export_Allocate(size_t size)
+{
+    Export *e = &exportG;
+    ExportRegion *region = NULL;
+
+    for (unsigned int i = 0; i < EXPORT_MAX_REGIONS; i++) {
+        if (!e->regions[i].base) {
+            region = &(e->regions[i]);
+            break;
+        }
+    }
+    if (!e->header || !region) {
+        return NULL;
+    }
+
+    size = Export_PageAlign(size);
+    if (ftruncate(e->fd, (off_t) (e->object_size + size))) {
+        return NULL;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd,
+                      (off_t) e->object_size);
+    if (base == MAP_FAILED) {
+        (void) ftruncate(e->fd, (off_t) e->object_size);
+        return NULL;
+    }
+
+    region->base = (uint8_t *) base;
+    region->offset = e->object_size;
+    region->size = size;
+    e->object_size += size;
+    __atomic_store_n(&(e->header->object_size), (uint64_t) e->object_size,
+                     __ATOMIC_RELEASE);
+
+    return base;
+}
+
+
+/* Frame arena: gives back an allocation; its pages are freed, although the
+   object keeps its size */
+static void Export_Release(void *base)
+{
+    Export *e = &exportG;
+
+    for (unsigned int i = 0; base && (i < EXPORT_MAX_REGIONS); i++) {
+        ExportRegion *region = &(e->regions[i]);
+        if (region->base != base) {
+            continue;
+        }
+        (void) munmap(region->base, region->size);
+#ifdef __linux__
+        (void) fallocate(e->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t) region->offset, (off_t) region->size);
+#endif
+        memset(region, 0, sizeof(*region));
+        return;
+    }
+}
+
+
+/* Runner thread: publishes the frame just made, which is in the arena */
+static void Export_PublishFrame(Export *e, const FrameSlot *slot,
+                                uint32_t frame)
+{
+    const uint8_t *data = (const uint8_t *) slot->video.data;
+    FrameArena *arena = &frameArenaG;
+
+    if (!slot->video_valid || (data < arena->base) ||
+        (data >= (arena->base + (FRAME_ARENA_BUFFERS *
+                                 arena->buffer_size)))) {
+        return;
+    }
+    const ExportRegion *region = NULL;
+    for (unsigned int i = 0; i < EXPORT_MAX_REGIONS; i++) {
+        if (e->regions[i].base == arena->base) {
+            region = &(e->regions[i]);
+        }
+    }
+    if (!region) {
+        return;
+    }
+
+    /* A frame that was drawn afresh finishes its buffer's generation; a
+       dupe is a frame already in a finished one */
+    ExportHeader *header = e->header;
+    uint32_t buffer = (uint32_t) ((data - arena->base) / arena->buffer_size);
+    uint32_t generation = header->generations[buffer];
+    if (generation & 1) {
+        generation += 1;
+        __atomic_store_n(&(header->generations[buffer]), generation,
+                         __ATOMIC_RELEASE);
+    }
+
+    uint32_t n = header->frames_published;
+    ExportFrame *f = &(header->frames[n % EXPORT_FRAME_SLOTS]);
+    __atomic_store_n(&(f->sequence), (2 * n) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    f->frame = frame;
+    f->timestamp_ns = Export_Now();
+    f->offset = region->offset + (size_t) (data - region->base);
+    f->width = slot->video.width;
+    f->height = slot->video.height;
+    f->pitch = (uint32_t) slot->video.pitch;
+    f->format = (uint32_t) pixelFormatG;
+    f->buffer = buffer;
+    f->generation = generation;
+    __atomic_store_n(&(f->sequence), (2 * n) + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&(header->frames_published), n + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Runner thread: publishes a block of audio, scaled by gain as it is for
+   the frontend */
+static void Export_PublishAudio(Export *e, int sample_rate,
+                                const int16_t *samples, uint32_t frames,
+                                int32_t gain, uint32_t frame)
+{
+    ExportHeader *header = e->header;
+
+    while (frames) {
+        uint32_t count = (frames > EXPORT_AUDIO_MAX_FRAMES) ?
+            EXPORT_AUDIO_MAX_FRAMES : frames;
+        uint32_t n = header->audio_published;
+        ExportAudio *a = &(header->audio[n % EXPORT_AUDIO_SLOTS]);
+        __atomic_store_n(&(a->sequence), (2 * n) + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        a->frame = frame;
+        a->timestamp_ns = Export_Now();
+        a->sample_rate = (uint32_t) sample_rate;
+        a->frames = count;
+        AudioRing_Copy(a->samples, samples, count, gain);
+        __atomic_store_n(&(a->sequence), (2 * n) + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&(header->audio_published), n + 1,
+                         __ATOMIC_RELEASE);
+        samples += 2 * count;
+        frames -= count;
+    }
+}
+
+
+/* ************************************************************************ */
+/* ************************************************************************ */
+
+
+/* ************************************************************************ */
+/* Game index
+/* ************************************************************************ */
+
+/* A table of the metadata that loading a game needs for every game libmame
+   knows, with a hash index from short name to game number.  Both are laid
+   out exactly as in a cache file in the frontend's system directory, so
+   that once the file has been written by one launch, later launches (and
+   anything else wanting to browse the game list) just map it.  The file is
+   rebuilt whenever the libmame version or the layout changes. */
+#define GAME_INDEX_MAGIC 0x314d4d52
+#define GAME_INDEX_FILE "libretromame_games.cache"
+#define GAME_INDEX_PATH_MAX 1024
+#define GAME_NAME_MAX 24
+
+typedef struct GameMetadata
+{
+    /* Short name, NUL terminated; empty if it was too long to index */
+    char name[GAME_NAME_MAX];
+    float refresh_rate_hz;
+    uint16_t width, height;
+    uint8_t players, screen_type, orientation, reserved;
+    uint32_t controller_flags, normal_button_flags;
+} GameMetadata;
+
+typedef struct GameIndexHeader
+{
+    uint32_t magic;
+    /* sizeof(GameMetadata), to catch layout changes */
+    uint32_t entry_size;
+    /* libmame version that the file was built with */
+    char version[64];
+    uint32_t count;
+    /* Size of the hash table following the games; a power of two */
+    uint32_t buckets;
+} GameIndexHeader;
+
+typedef struct GameIndex
+{
+    /* The whole file image, mapped or in memory */
+    uint8_t *base;
+    size_t size;
+    bool mapped;
+    const GameIndexHeader *header;
+    const GameMetadata *games;
+    /* Game numbers, -1 for an empty bucket; linear probing */
+    const int32_t *buckets;
+} GameIndex;
+
+static GameIndex gameIndexG;
+
+
+static uint32_t GameIndex_Hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+
+/* Asks libmame for one game's metadata */
+static void GameIndex_Query(int gamenum, GameMetadata *meta)
+{
+    memset(meta, 0, sizeof(*meta));
+
+    const char *name = LibMame_Get_Game_Short_Name(gamenum);
+    if (name && (strlen(name) < GAME_NAME_MAX)) {
+        strcpy(meta->name, name);
+    }
+    meta->refresh_rate_hz = LibMame_GetGame_ScreenRefreshRateHz(gamenum);
+    LibMame_ScreenResolution resolution =
+        LibMame_Get_Game_ScreenResolution(gamenum);
+    meta->width = (uint16_t) resolution.width;
+    meta->height = (uint16_t) resolution.height;
+    meta->players = (uint8_t) LibMame_Get_Game_MaxSimultaneousPlayers(gamenum);
+    meta->screen_type = (uint8_t) LibMame_Get_Game_ScreenType(gamenum);
+    meta->orientation = (uint8_t) LibMame_Get_Game_Orientation(gamenum);
+    LibMame_AllControllers controllers;
+    LibMame_Get_Game_AllControllers(gamenum, &controllers);
+    meta->controller_flags = controllers.controller_flags;
+    meta->normal_button_flags = controllers.normal_button_flags;
+}
+
+
+static size_t GameIndex_Size(uint32_t count, uint32_t buckets)
+{
+    return sizeof(GameIndexHeader) + (count * sizeof(GameMetadata)) +
+        (buckets * sizeof(int32_t));
+}
+
+
+/* Whether the games and buckets of an image can be searched safely: every
+   name is NUL terminated, every bucket is empty or holds a game number,
+   and some bucket is empty, which ends every probe */
+static bool GameIndex_Check(const GameIndexHeader *header)
+{
+    const GameMetadata *games = (const GameMetadata *) (header + 1);
+    const int32_t *buckets = (const int32_t *) (games + header->count);
+    bool empty = false;
+
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (!memchr(games[i].name, 0, sizeof(games[i].name))) {
+            return false;
+        }
+    }
+    for (uint32_t b = 0; b < header->buckets; b++) {
+        if (buckets[b] < 0) {
+            empty = true;
+        }
+        else if ((uint32_t) buckets[b] >= header->count) {
+            return false;
+        }
+    }
+
+    return empty;
+}
+
+
+/* Points the index at an image of size bytes, if it is a valid one */
+static bool GameIndex_Attach(GameIndex *index, uint8_t *base, size_t size,
+                             const char *version)
+{
+    const GameIndexHeader *header = (const GameIndexHeader *) base;
+
+    if ((size < sizeof(*header)) || (header->magic != GAME_INDEX_MAGIC) ||
+        (header->entry_size != sizeof(GameMetadata)) ||
+        strncmp(header->version, version, sizeof(header->version)) ||
+        !header->buckets || (header->buckets & (header->buckets - 1)) ||
+        (header->count > header->buckets) ||
+        /* Bounding both by the size keeps GameIndex_Size() from overflowing */
+        (header->buckets > (size / sizeof(int32_t))) ||
+        (header->count > (size / sizeof(GameMetadata))) ||
+        (size != GameIndex_Size(header->count, header->buckets)) ||
+        !GameIndex_Check(header)) {
+        return false;
+    }
+
+    index->base = base;
+    index->size = size;
+    index->header = header;
+    index->games = (const GameMetadata *) (header + 1);
+    index->buckets = (const int32_t *) (index->games + header->count);
+
+    return true;
+}
+
+
+/* Builds a fresh image from libmame; returns NULL on allocation failure */
+static uint8_t *GameIndex_Build(const char *version, size_t *size)
+{
+    int count = LibMame_Get_Game_Count();
+    if (count < 0) {
+        count = 0;
+    }
+
+    uint32_t buckets = 1;
+    while (buckets < (2 * (uint32_t) count)) {
+        buckets *= 2;
+    }
+
+    *size = GameIndex_Size((uint32_t) count, buckets);
+    uint8_t *base = (uint8_t *) calloc(1, *size);
+    if (!base) {
+        return NULL;
+    }
+
+    GameIndexHeader *header = (GameIndexHeader *) base;
+    header->magic = GAME_INDEX_MAGIC;
+    header->entry_size = sizeof(GameMetadata);
+    snprintf(header->version, sizeof(header->version), "%s", version);
+    header->count = (uint32_t) count;
+    header->buckets = buckets;
+
+    GameMetadata *games = (GameMetadata *) (header + 1);
+    int32_t *table = (int32_t *) (games + count);
+    memset(table, 0xff, buckets * sizeof(int32_t));
+
+    for (int i = 0; i < count; i++) {
+        GameIndex_Query(i, &(games[i]));
+        if (!games[i].name[0]) {
+            continue;
+        }
+        uint32_t b = GameIndex_Hash(games[i].name) & (buckets - 1);
+        while (table[b] >= 0) {
+            b = (b + 1) & (buckets - 1);
+        }
+        table[b] = i;
+    }
+
+    return base;
+}
+
+
+/* Writes the image to path, atomically replacing any old file */
+static void GameIndex_Save(const uint8_t *base, size_t size, const char *path)
+{
+    char tmp[GAME_INDEX_PATH_MAX + 16];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >=
+        (int) sizeof(tmp)) {
+        return;
+    }
+
+    FILE *file = fopen(tmp, "wb");
+    if (!file) {
+        return;
+    }
+
+    bool ok = (fwrite(base, 1, size, file) == size);
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp, path)) {
+        (void) unlink(tmp);
+    }
+}
+
+
+/* Maps the cache file in directory, or builds the index and saves it there;
+   directory may be NULL, in which case the index is only kept in memory */
+static void GameIndex_Open(GameIndex *index, const char *directory)
+{
+    const char *version = LibMame_Get_Version_String();
+    char path[GAME_INDEX_PATH_MAX];
+
+    memset(index, 0, sizeof(*index));
+    if (!version) {
+        version = "";
+    }
+
+    /* A directory too long for the path is as good as none */
+    if (directory &&
+        (snprintf(path, sizeof(path), "%s/%s", directory, GAME_INDEX_FILE) >=
+         (int) sizeof(path))) {
+        directory = NULL;
+    }
+
+    if (directory) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd >= 0) {
+            if (!fstat(fd, &st) && (st.st_size > 0)) {
+                void *base = mmap(NULL, (size_t) st.st_size, PROT_READ,
+                                  MAP_SHARED, fd, 0);
+                if (base != MAP_FAILED) {
+                    if (GameIndex_Attach(index, (uint8_t *) base,
+                                         (size_t) st.st_size, version)) {
+                        index->mapped = true;
+                    }
+                    else {
+                        (void) munmap(base, (size_t) st.st_size);
+                    }
+                }
+            }
+            (void) close(fd);
+        }
+        if (index->mapped) {
+            return;
+        }
+    }
+
+    size_t size;
+    uint8_t *base = GameIndex_Build(version, &size);
+    if (!base) {
+        return;
+    }
+    (void) GameIndex_Attach(index, base, size, version);
+    if (directory) {
+        GameIndex_Save(base, size, path);
+    }
+}
+
+
+static void GameIndex_Close(GameIndex *index)
+{
+    if (index->mapped) {
+        (void) munmap(index->base, index->size);
+    }
+    else {
+        free(index->base);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+
+/* Returns the number of the game with the given short name, or -1 */
+static int GameIndex_Find(const GameIndex *index, const char *name)
+{
+    if (index->header) {
+        uint32_t mask = index->header->buckets - 1;
+        uint32_t b = GameIndex_Hash(name) & mask;
+        int32_t gamenum;
+        while ((gamenum = index->buckets[b]) >= 0) {
+            if (!strcmp(index->games[gamenum].name, name)) {
+                return gamenum;
+            }
+            b = (b + 1) & mask;
+        }
+        /* Names too long for the index are not in it */
+        if (strlen(name) < GAME_NAME_MAX) {
+            return -1;
+        }
+    }
+
+    return LibMame_Get_Game_Number(name);
+}
+
+
+/* Estimates how demanding a game is, on the 1 to 4 scale of
+   RETRO_ENVIRONMENT_SET_PERFORMANCE_LEVEL, from the clocks of its CPUs and
+   the number of its sound chips; emulation cost grows with both */
+static unsigned int GameIndex_PerformanceLevel(int gamenum)
+{
+    double mhz = 0;
+    int sound_chips = 0;
+
+    int count = LibMame_Get_Game_Chip_Count(gamenum);
+    for (int i = 0; i < count; i++) {
+        LibMame_Chip chip = LibMame_Get_Game_Chip(gamenum, i);
+        if (chip.is_sound) {
+            sound_chips += 1;
+        }
+        else {
+            mhz += chip.clock_hz / 1e6;
+        }
+    }
+
+    /* Each sound chip costs about as much as a slow CPU */
+    double score = mhz + (4.0 * sound_chips);
+    if (score <= 24) {
+        return 1;
+    }
+    else if (score <= 100) {
+        return 2;
+    }
+    else if (score <= 400) {
+        return 3;
+    }
+    return 4;
+}
+
+
+/* The rotation, counter-clockwise in quarter turns as the frontend counts
+   it, that shows a game's screen upright: MAME's orientations turn the
+   screen clockwise */
+static unsigned int GameIndex_Rotation(const GameMetadata *meta)
+{
+    switch (meta->orientation) {
+    case LibMame_OrientationType_90:
+        return 3;
+    case LibMame_OrientationType_180:
+        return 2;
+    case LibMame_OrientationType_270:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+/* Fills in meta for a game, from the index if there is one */
+static void GameIndex_Get(const GameIndex *index, int gamenum,
+                          GameMetadata *meta)
+{
+    if (index->header && (gamenum >= 0) &&
+        ((uint32_t) gamenum < index->header->count)) {
+        *meta = index->games[gamenum];
+    }
+    else {
+        GameIndex_Query(gamenum, meta);
+    }
+}
+
+
+/* ************************************************************************ */
+/* ROM cache
+/* ************************************************************************ */
+
+/* MAME inflates the ROMs of a zipped set every time the set is loaded, and
+   with the sets on a slow or remote disk that is most of what loading
+   costs.  So each set is unpacked once into a cache in the system
+   directory, as the plain files that MAME accepts just as well, and MAME's
+   ROM path has the cache ahead of the set's own directory, where it still
+   finds any parent or BIOS sets.
+
+   A cache entry is named after the set and the CRC of the zip's central
+   directory, which holds the CRC of every file in it, so a set that
+   changes gets a fresh entry.  Entries are unpacked under a temporary name
+   and renamed into place, so that any number of core instances on a host
+   can share the cache; the files are read only, and instances playing the
+   same set share its pages through the page cache.  Files are inflated
+   straight into their mappings.
+
+   The zip is mapped from its file, so a set that is already in the cache
+   costs no more than reading its central directory.  A frontend that
+   hands over a buffer anyway has it used instead.
+
+   Each load touches its entry, and then trims the cache: entries for older
+   versions of the set go, as do temporary directories left by instances
+   that died while unpacking, and then the least recently used entries
+   until the cache is back under its size limit. */
+#define ROM_CACHE_DIRECTORY "libretromame_roms"
+#define ROM_CACHE_PATH_MAX 1024
+/* How far below an entry its files are: "<entry>/<set>/<file>" */
+#define ROM_CACHE_DEPTH 2
+
+#define ZIP_LOCAL_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE 0x06054b50
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_END_SIZE 22
+/* The end record is followed by a comment of up to 64K */
+#define ZIP_END_SEARCH (ZIP_END_SIZE + 0xffff)
+
+typedef struct ZipArchive
+{
+    const uint8_t *data;
+    size_t size;
+    const uint8_t *central;
+    size_t central_size;
+    uint32_t count;
+} ZipArchive;
+
+/* One file of a zip, as its central directory entry describes it */
+typedef struct ZipEntry
+{
+    char name[256];
+    uint16_t method;
+    uint32_t crc, compressed_size, size;
+    /* Where the file's data starts in the zip */
+    size_t offset;
+} ZipEntry;
+
+/* An entry met while trimming the cache, that may be evicted */
+typedef struct RomCacheUse
+{
+    char name[256];
+    /* When a load last touched it */
+    time_t used;
+    uint64_t bytes;
+} RomCacheUse;
+
+/* "<system directory>/libretromame_roms", or empty if there is no system
+   directory */
+static char romCacheDirectoryG[ROM_CACHE_PATH_MAX];
+/* Core option: how many bytes the cache may take, or 0 for no limit */
+static uint64_t romCacheLimitG;
+
+
+static inline uint32_t Zip_Read16(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8);
+}
+
+
+static inline uint32_t Zip_Read32(const uint8_t *p)
+{
+    return Zip_Read16(p) | (Zip_Read16(p + 2) << 16);
+}
+
+
+/* Finds the central directory of a zip; returns false if data is not one,
+   or is one that the cache doesn't handle (split or zip64) */
+static bool Zip_Open(ZipArchive *zip, const uint8_t *data, size_t size)
+{
+    if (size < ZIP_END_SIZE) {
+        return false;
+    }
+
+    size_t stop = (size > ZIP_END_SEARCH) ? (size - ZIP_END_SEARCH) : 0;
+    for (size_t at = size - ZIP_END_SIZE; ; at--) {
+        const uint8_t *end = data + at;
+        if (Zip_Read32(end) == ZIP_END_SIGNATURE) {
+            uint32_t count = Zip_Read16(end + 10);
+            uint32_t central_size = Zip_Read32(end + 12);
+            uint32_t central = Zip_Read32(end + 16);
+            if (Zip_Read16(end + 4) || Zip_Read16(end + 6) ||
+                (count != Zip_Read16(end + 8)) ||
+                (central > at) || (central_size > (at - central))) {
+                return false;
+            }
+            zip->data = data;
+            zip->size = size;
+            zip->central = data + central;
+            zip->central_size = central_size;
+            zip->count = count;
+            return true;
+        }
+        if (at == stop) {
+            return false;
+        }
+    }
+}
+
+
+/* Reads the central directory entry at *at, moving *at on to the next one;
+   returns false if the entry is malformed or describes something the cache
+   doesn't handle */
+static bool Zip_Entry(const ZipArchive *zip, size_t *at, ZipEntry *entry)
+{
+    const uint8_t *p = zip->central + *at;
+    size_t left = zip->central_size - *at;
+
+    if ((left < ZIP_CENTRAL_SIZE) ||
+        (Zip_Read32(p) != ZIP_CENTRAL_SIGNATURE)) {
+        return false;
+    }
+    uint32_t flags = Zip_Read16(p + 8);
+    uint32_t name_length = Zip_Read16(p + 28);
+    size_t length = ZIP_CENTRAL_SIZE + name_length + Zip_Read16(p + 30) +
+        Zip_Read16(p + 32);
+    if ((length > left) || (name_length >= sizeof(entry->name)) ||
+        /* Encrypted */
+        (flags & 1)) {
+        return false;
+    }
+    *at += length;
+
+    entry->method = (uint16_t) Zip_Read16(p + 10);
+    entry->crc = Zip_Read32(p + 16);
+    entry->compressed_size = Zip_Read32(p + 20);
+    entry->size = Zip_Read32(p + 24);
+    memcpy(entry->name, p + ZIP_CENTRAL_SIZE, name_length);
+    entry->name[name_length] = 0;
+
+    /* The data follows the local header, whose name and extra field need
+       not be the same length as the central directory's */
+    size_t local = Zip_Read32(p + 42);
+    if ((local > zip->size) || ((zip->size - local) < ZIP_LOCAL_SIZE) ||
+        (Zip_Read32(zip->data + local) != ZIP_LOCAL_SIGNATURE)) {
+        return false;
+    }
+    entry->offset = local + ZIP_LOCAL_SIZE +
+        Zip_Read16(zip->data + local + 26) +
+        Zip_Read16(zip->data + local + 28);
+
+    return ((entry->offset <= zip->size) &&
+            (entry->compressed_size <= (zip->size - entry->offset)));
+}
+
+
+/* Whether a zip entry is a plain file in the top directory, which is
+   everything that MAME looks for in a set */
+static bool Zip_IsPlainFile(const ZipEntry *entry)
+{
+    return (entry->name[0] && strcmp(entry->name, ".") &&
+            strcmp(entry->name, "..") && !strchr(entry->name, '/') &&
+            !strchr(entry->name, '\\'));
+}
+
+
+/* Writes one file of a zip into directory, inflating it straight into the
+   file's mapping, and checks its CRC */
+static bool RomCache_Extract(const ZipArchive *zip, const ZipEntry *entry,
+                             const char *directory)
+{
+    char path[ROM_CACHE_PATH_MAX + 256];
+    if (snprintf(path, sizeof(path), "%s/%s", directory, entry->name) >=
+        (int) sizeof(path)) {
+        return false;
+    }
+
+    const uint8_t *src = zip->data + entry->offset;
+    if (((entry->method == 0) &&
+         (entry->compressed_size != entry->size)) ||
+        ((entry->method != 0) && (entry->method != 8))) {
+        return false;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0444);
+    if (fd < 0) {
+        return false;
+    }
+    if (!entry->size) {
+        (void) close(fd);
+        return (entry->crc == 0);
+    }
+
+    bool ok = false;
+    uint8_t *dest = MAP_FAILED;
+    if (!ftruncate(fd, (off_t) entry->size)) {
+        dest = (uint8_t *) mmap(NULL, entry->size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    }
+    if (dest != MAP_FAILED) {
+        if (entry->method == 0) {
+            memcpy(dest, src, entry->size);
+            ok = true;
+        }
+        else {
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            /* Raw deflate data, without a zlib header */
+            if (inflateInit2(&stream, -MAX_WBITS) == Z_OK) {
+                stream.next_in = (Bytef *) src;
+                stream.avail_in = entry->compressed_size;
+                stream.next_out = dest;
+                stream.avail_out = entry->size;
+                ok = ((inflate(&stream, Z_FINISH) == Z_STREAM_END) &&
+                      (stream.total_out == entry->size));
+                (void) inflateEnd(&stream);
+            }
+        }
+        ok = ok && (crc32(crc32(0, NULL, 0), dest, entry->size) ==
+                    entry->crc);
+        (void) munmap(dest, entry->size);
+    }
+    (void) close(fd);
+
+    return ok;
+}
+
+
+/* Adds up the disk space that path takes, and everything under it down to
+   depth levels, removing it all as well if remove is set */
+static uint64_t RomCache_Walk(const char *path, bool remove, int depth)
+{
+    struct stat st;
+    if (lstat(path, &st)) {
+        return 0;
+    }
+
+    uint64_t bytes = (uint64_t) st.st_blocks * 512;
+    if (!S_ISDIR(st.st_mode)) {
+        if (remove) {
+            (void) unlink(path);
+        }
+        return bytes;
+    }
+
+    DIR *dir = (depth > 0) ? opendir(path) : NULL;
+    if (dir) {
+        char child[ROM_CACHE_PATH_MAX + 256];
+        struct dirent *d;
+        while ((d = readdir(dir))) {
+            if (strcmp(d->d_name, ".") && strcmp(d->d_name, "..") &&
+                (snprintf(child, sizeof(child), "%s/%s", path, d->d_name) <
+                 (int) sizeof(child))) {
+                bytes += RomCache_Walk(child, remove, depth - 1);
+            }
+        }
+        (void) closedir(dir);
+    }
+    if (remove) {
+        (void) rmdir(path);
+    }
+
+    return bytes;
+}
+
+
+/* Writes every file of a zip into a new directory */
+static bool RomCache_Unpack(const ZipArchive *zip, const char *directory)
+{
+    if (mkdir(directory, 0755)) {
+        return false;
+    }
+
+    ZipEntry entry;
+    size_t at = 0;
+    for (uint32_t i = 0; i < zip->count; i++) {
+        if (!Zip_Entry(zip, &at, &entry)) {
+            return false;
+        }
+        if (Zip_IsPlainFile(&entry) &&
+            !RomCache_Extract(zip, &entry, directory)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* Whether directory exists */
+static bool RomCache_Exists(const char *directory)
+{
+    struct stat st;
+    return (!stat(directory, &st) && S_ISDIR(st.st_mode));
+}
+
+
+/* Whether name is that of a cache entry, "<set>-<crc>"; if set is not
+   NULL, of an entry for that set */
+static bool RomCache_IsEntry(const char *name, const char *set)
+{
+    const char *dash = strrchr(name, '-');
+    if (!dash || (dash == name) || (strlen(dash + 1) != 8) ||
+        (strspn(dash + 1, "0123456789abcdef") != 8)) {
+        return false;
+    }
+
+    return (!set || ((strlen(set) == (size_t) (dash - name)) &&
+                     !strncmp(name, set, strlen(set))));
+}
+
+
+/* Returns the pid of the instance unpacking into the directory named name,
+   "<entry>.<pid>", or 0 if name is not that of such a directory */
+static long RomCache_UnpackerPid(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    if (!dot || !dot[1] || (strspn(dot + 1, "0123456789") !=
+                            strlen(dot + 1))) {
+        return 0;
+    }
+
+    return strtol(dot + 1, NULL, 10);
+}
+
+
+static int RomCache_CompareUse(const void *a, const void *b)
+{
+    const RomCacheUse *x = (const RomCacheUse *) a;
+    const RomCacheUse *y = (const RomCacheUse *) b;
+
+    return (x->used < y->used) ? -1 : (x->used > y->used) ? 1 : 0;
+}
+
+
+/* Tidies the cache once the entry named keep has been made or used for the
+   set named set.  What instances that are no longer running left half
+   unpacked goes, as do the entries for older versions of set, and then
+   the least recently used entries until the cache fits in limit bytes (if
+   limit isn't 0).  keep itself is never removed. */
+static void RomCache_Clean(const char *set, const char *keep, uint64_t limit)
+{
+    DIR *dir = opendir(romCacheDirectoryG);
+    if (!dir) {
+        return;
+    }
+
+    RomCacheUse *uses = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    char path[ROM_CACHE_PATH_MAX + 256];
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if ((d->d_name[0] == '.') ||
+            (strlen(d->d_name) >= sizeof(uses->name)) ||
+            (snprintf(path, sizeof(path), "%s/%s", romCacheDirectoryG,
+                      d->d_name) >= (int) sizeof(path))) {
+            continue;
+        }
+
+        long pid = RomCache_UnpackerPid(d->d_name);
+        if (pid) {
+            if ((pid > 0) && kill((pid_t) pid, 0) && (errno == ESRCH)) {
+                (void) RomCache_Walk(path, true, ROM_CACHE_DEPTH);
+            }
+        }
+        else if (!RomCache_IsEntry(d->d_name, NULL)) {
+            /* Not the cache's */
+        }
+        else if (!strcmp(d->d_name, keep)) {
+            total += RomCache_Walk(path, false, ROM_CACHE_DEPTH);
+        }
+        else if (RomCache_IsEntry(d->d_name, set)) {
+            (void) RomCache_Walk(path, true, ROM_CACHE_DEPTH);
+        }
+        else if (limit) {
+            struct stat st;
+            if (stat(path, &st)) {
+                continue;
+            }
+            if (count == capacity) {
+                size_t grown = capacity ? (2 * capacity) : 64;
+                RomCacheUse *more = (RomCacheUse *) realloc
+                    (uses, grown * sizeof(RomCacheUse));
+                if (!more) {
+                    continue;
+                }
+                uses = more;
+                capacity = grown;
+            }
+            RomCacheUse *use = &(uses[count++]);
+            strcpy(use->name, d->d_name);
+            use->used = st.st_mtime;
+            use->bytes = RomCache_Walk(path, false, ROM_CACHE_DEPTH);
+            total += use->bytes;
+        }
+    }
+    (void) closedir(dir);
+
+    if (count) {
+        qsort(uses, count, sizeof(RomCacheUse), &RomCache_CompareUse);
+    }
+    for (size_t i = 0; (i < count) && (total > limit); i++) {
+        if (snprintf(path, sizeof(path), "%s/%s", romCacheDirectoryG,
+                     uses[i].name) < (int) sizeof(path)) {
+            (void) RomCache_Walk(path, true, ROM_CACHE_DEPTH);
+            total -= uses[i].bytes;
+        }
+    }
+    free(uses);
+}
+
+
+/* Finds or makes the cache entry for the set named name, held in the zip
+   at data, or if that is NULL, in the file at path; on success, writes the
+   directory that MAME should find the set's directory in to entry */
+static bool RomCache_Prepare(const char *name, const void *data, size_t size,
+                             const char *path, char *entry,
+                             size_t entry_size)
+{
+    if (!romCacheDirectoryG[0]) {
+        return false;
+    }
+
+    void *mapped = NULL;
+    if (!data) {
+        int fd = path ? open(path, O_RDONLY) : -1;
+        struct stat st;
+        if (fd < 0) {
+            return false;
+        }
+        if (!fstat(fd, &st) && (st.st_size > 0)) {
+            size = (size_t) st.st_size;
+            mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        (void) close(fd);
+        if (!mapped || (mapped == MAP_FAILED)) {
+            return false;
+        }
+        data = mapped;
+    }
+
+    /* The paths of the entry, of the set in it, and of both while this
+       instance is unpacking them */
+    char set[ROM_CACHE_PATH_MAX], tmp[ROM_CACHE_PATH_MAX];
+    char tmp_set[ROM_CACHE_PATH_MAX];
+    ZipArchive zip;
+    bool ok = Zip_Open(&zip, (const uint8_t *) data, size);
+    if (ok) {
+        uint32_t crc = crc32(crc32(0, NULL, 0), zip.central,
+                             zip.central_size);
+        int pid = (int) getpid();
+        ok = ((snprintf(entry, entry_size, "%s/%s-%08x", romCacheDirectoryG,
+                        name, crc) < (int) entry_size) &&
+              (snprintf(set, sizeof(set), "%s/%s", entry, name) <
+               (int) sizeof(set)) &&
+              (snprintf(tmp, sizeof(tmp), "%s.%d", entry, pid) <
+               (int) sizeof(tmp)) &&
+              (snprintf(tmp_set, sizeof(tmp_set), "%s/%s", tmp, name) <
+               (int) sizeof(tmp_set)));
+    }
+    if (ok && !RomCache_Exists(set)) {
+        /* Unpack into a directory of this instance's own, and then move it
+           into place; if another instance got there first, use its entry */
+        (void) mkdir(romCacheDirectoryG, 0755);
+        ok = (!mkdir(tmp, 0755) && RomCache_Unpack(&zip, tmp_set) &&
+              !rename(tmp, entry));
+        if (!ok) {
+            (void) RomCache_Walk(tmp, true, ROM_CACHE_DEPTH);
+            ok = RomCache_Exists(set);
+        }
+    }
+    if (ok) {
+        (void) utimensat(AT_FDCWD, entry, NULL, 0);
+        RomCache_Clean(name, entry + strlen(romCacheDirectoryG) + 1,
+                       romCacheLimitG);
+    }
+
+    if (mapped) {
+        (void) munmap(mapped, size);
+    }
+
+    return ok;
+}
+
+
+/* ************************************************************************ */
+/* Input plan
+/* ************************************************************************ */
+
+/* The libretro controls that the loaded game uses, worked out once from its
+   controller metadata at retro_load_game().  Each entry reads one libretro
+   input and folds it into one field of a LibMame_AllControlsState, so that
+   each frame only queries what the game has.
+
+   retro_run() evaluates the plan after polling input and publishes the
+   result through a sequence lock; PollAllControlsStateCb() on the runner
+   thread copies out the latest result.  In pipelined mode the runner may
+   be reading while retro_run() publishes the next frame's input, and the
+   sequence lock makes it retry rather than see half of each. */
+#define INPUT_PLAN_MAX 256
+
+typedef struct InputPlanEntry
+{
+    /* The libretro input */
+    uint8_t port, device, index, id;
+    /* An axis adds the input times scale to its field; a button sets bit
+       shift of its field while pressed */
+    bool axis;
+    uint8_t shift;
+    int16_t scale;
+    /* Byte offset of the field in LibMame_AllControlsState */
+    uint16_t offset;
+} InputPlanEntry;
+
+static InputPlanEntry inputPlanG[INPUT_PLAN_MAX];
+static unsigned int inputPlanCountG;
+
+typedef struct InputLatch
+{
+    /* Odd while the state is being written */
+    volatile uint32_t sequence;
+    LibMame_AllControlsState state;
+} InputLatch;
+
+static InputLatch inputLatchG;
+
+/* MAME's analog inputs span -65536 to 65536, libretro's half that */
+#define INPUT_ANALOG_SCALE 2
+
+/* Joypad buttons in the order that MAME numbers a game's buttons */
+static const uint8_t inputButtonIdsG[] =
+{
+    RETRO_DEVICE_ID_JOYPAD_B, RETRO_DEVICE_ID_JOYPAD_A,
+    RETRO_DEVICE_ID_JOYPAD_Y, RETRO_DEVICE_ID_JOYPAD_X,
+    RETRO_DEVICE_ID_JOYPAD_L, RETRO_DEVICE_ID_JOYPAD_R,
+    RETRO_DEVICE_ID_JOYPAD_L2, RETRO_DEVICE_ID_JOYPAD_R2,
+    RETRO_DEVICE_ID_JOYPAD_L3, RETRO_DEVICE_ID_JOYPAD_R3
+};
+
+#define INPUT_FIELD(player, field)                                         \
+    (offsetof(LibMame_AllControlsState, per_player) +                     \
+     ((player) * sizeof(LibMame_PerPlayerControlsState)) +                 \
+     offsetof(LibMame_PerPlayerControlsState, field))
+
+
+static void InputPlan_Add(unsigned int port, unsigned int device,
+                          unsigned int index, unsigned int id, size_t offset,
+                          bool axis, unsigned int shift, int scale)
+{
+    if (inputPlanCountG == INPUT_PLAN_MAX) {
+        return;
+    }
+
+    InputPlanEntry *e = &(inputPlanG[inputPlanCountG++]);
+    e->port = (uint8_t) port;
+    e->device = (uint8_t) device;
+    e->index = (uint8_t) index;
+    e->id = (uint8_t) id;
+    e->axis = axis;
+    e->shift = (uint8_t) shift;
+    e->scale = (int16_t) scale;
+    e->offset = (uint16_t) offset;
+}
+
+
+#define INPUT_PLAN_BUTTON(player, device, id, field, shift)                \
+    InputPlan_Add(player, device, 0, id, INPUT_FIELD(player, field), false, \
+                  shift, 0)
+#define INPUT_PLAN_AXIS(player, device, index, id, field, scale)           \
+    InputPlan_Add(player, device, index, id, INPUT_FIELD(player, field),   \
+                  true, 0, scale)
+
+
+/* Builds the plan for a game; each player is on the libretro port of the
+   same number */
+static void InputPlan_Build(const GameMetadata *meta)
+{
+    uint32_t types = meta->controller_flags;
+#define HAS(type) (types & (1 << LibMame_ControllerType_##type))
+    bool joystick = (HAS(Joystick4Way) || HAS(Joystick8Way));
+    bool horizontal = (joystick || HAS(JoystickHorizontal));
+    bool vertical = (joystick || HAS(JoystickVertical));
+
+    int players = meta->players;
+    if (players > LIBMAME_CONTROLLER_MAX_PLAYERS) {
+        players = LIBMAME_CONTROLLER_MAX_PLAYERS;
+    }
+
+    inputPlanCountG = 0;
+    for (int p = 0; p < players; p++) {
+        INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD, RETRO_DEVICE_ID_JOYPAD_START,
+                          start_button_state, 0);
+        INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD,
+                          RETRO_DEVICE_ID_JOYPAD_SELECT, coin_button_state,
+                          0);
+        if (horizontal) {
+            INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD,
+                              RETRO_DEVICE_ID_JOYPAD_LEFT,
+                              left_or_single_joystick_left_state, 0);
+            INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD,
+                              RETRO_DEVICE_ID_JOYPAD_RIGHT,
+                              left_or_single_joystick_right_state, 0);
+        }
+        if (vertical) {
+            INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD,
+                              RETRO_DEVICE_ID_JOYPAD_UP,
+                              left_or_single_joystick_up_state, 0);
+            INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD,
+                              RETRO_DEVICE_ID_JOYPAD_DOWN,
+                              left_or_single_joystick_down_state, 0);
+        }
+        for (unsigned int b = 0;
+             b < (sizeof(inputButtonIdsG) / sizeof(inputButtonIdsG[0]));
+             b++) {
+            if ((meta->normal_button_flags & (1 << b)) &&
+                !(!p && (inputButtonIdsG[b] == rewindButtonG))) {
+                INPUT_PLAN_BUTTON(p, RETRO_DEVICE_JOYPAD, inputButtonIdsG[b],
+                                  normal_buttons_state, b);
+            }
+        }
+        if (HAS(AnalogJoystick)) {
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_ANALOG,
+                            RETRO_DEVICE_INDEX_ANALOG_LEFT,
+                            RETRO_DEVICE_ID_ANALOG_X,
+                            analog_joystick_horizontal_state,
+                            INPUT_ANALOG_SCALE);
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_ANALOG,
+                            RETRO_DEVICE_INDEX_ANALOG_LEFT,
+                            RETRO_DEVICE_ID_ANALOG_Y,
+                            analog_joystick_vertical_state,
+                            INPUT_ANALOG_SCALE);
+        }
+        /* Spinners and paddles are driven by the mouse too */
+        if (HAS(Trackball) || HAS(Dial) || HAS(Paddle)) {
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_MOUSE, 0, RETRO_DEVICE_ID_MOUSE_X,
+                            trackball_horizontal_state, 1);
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_MOUSE, 0, RETRO_DEVICE_ID_MOUSE_Y,
+                            trackball_vertical_state, 1);
+        }
+        if (HAS(Lightgun)) {
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_LIGHTGUN, 0,
+                            RETRO_DEVICE_ID_LIGHTGUN_X,
+                            lightgun_horizontal_state, 1);
+            INPUT_PLAN_AXIS(p, RETRO_DEVICE_LIGHTGUN, 0,
+                            RETRO_DEVICE_ID_LIGHTGUN_Y,
+                            lightgun_vertical_state, 1);
+            INPUT_PLAN_BUTTON(p, RETRO_DEVICE_LIGHTGUN,
+                              RETRO_DEVICE_ID_LIGHTGUN_TRIGGER,
+                              normal_buttons_state, 0);
+        }
+    }
+#undef HAS
+
+    memset(&inputLatchG, 0, sizeof(inputLatchG));
+}
+
+
+/* Reads every input in the plan into state */
+static void InputPlan_Evaluate(LibMame_AllControlsState *state)
+{
+    retro_input_state_t input = retroInputStateG;
+    const InputPlanEntry *e = inputPlanG, *end = e + inputPlanCountG;
+
+    memset(state, 0, sizeof(*state));
+
+    for ( ; e != end; e++) {
+        int value = (input)(e->port, e->device, e->index, e->id);
+        int *field = (int *) (((uint8_t *) state) + e->offset);
+        if (e->axis) {
+            *field += value * e->scale;
+        }
+        else {
+            *field |= (value != 0) << e->shift;
+        }
+    }
+}
+
+
+/* Frontend thread */
+static void InputLatch_Publish(InputLatch *latch,
+                               const LibMame_AllControlsState *state)
+{
+    uint32_t sequence = latch->sequence;
+
+    __atomic_store_n(&(latch->sequence), sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    latch->state = *state;
+    __atomic_store_n(&(latch->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+/* Runner thread */
+static void InputLatch_Read(const InputLatch *latch,
+                            LibMame_AllControlsState *state)
+{
+    uint32_t sequence;
+
+    do {
+        while ((sequence = __atomic_load_n(&(latch->sequence),
+                                           __ATOMIC_ACQUIRE)) & 1) {
+            Handoff_CpuRelax();
+        }
+        *state = latch->state;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(latch->sequence), __ATOMIC_RELAXED) !=
+             sequence);
+}
+
+
+/* ************************************************************************ */
+/* Frame skip
+/* ************************************************************************ */
+
+/* When emulating a frame takes longer than a frame lasts, skipping the
+   conversion and presentation of some frames (the frontend shows the last
+   one again) gives the time back, while every frame's audio still plays.
+
+   The auto policy keeps a debt: each frame adds the time retro_run() spent
+   waiting for the runner, less the budget, which is a share of the frame
+   time; a frame is skipped while the debt is positive.  Skipped frames are
+   cheaper, which pays the debt back.  The fixed policy skips the same
+   number of frames for every one shown.  Either way, no more than max
+   frames are skipped in a row.  A pipelined runner is already emulating the
+   next frame when retro_run() decides, so frames are never skipped in
+   pipelined mode. */
+typedef enum FrameSkipPolicy
+{
+    FrameSkipPolicy_Disabled,
+    FrameSkipPolicy_Auto,
+    FrameSkipPolicy_Fixed
+} FrameSkipPolicy;
+
+typedef struct FrameSkip
+{
+    FrameSkipPolicy policy;
+    unsigned int max;
+    int64_t budget_ns;
+    int64_t debt_ns;
+    /* Frames skipped since the last one shown */
+    unsigned int run;
+    uint64_t shown, skipped;
+} FrameSkip;
+
+static FrameSkip frameSkipG;
+
+
+static void FrameSkip_Configure(FrameSkip *skip, const char *policy,
+                                const char *max, const char *threshold,
+                                double fps)
+{
+    memset(skip, 0, sizeof(*skip));
+
+    if (policy && !strcmp(policy, "auto")) {
+        skip->policy = FrameSkipPolicy_Auto;
+    }
+    else if (policy && !strcmp(policy, "fixed")) {
+        skip->policy = FrameSkipPolicy_Fixed;
+    }
+    skip->max = max ? (unsigned int) atoi(max) : 2;
+    if (fps <= 0) {
+        fps = 60;
+    }
+    skip->budget_ns = (int64_t) ((threshold ? atoi(threshold) : 90) *
+                                 (1e7 / fps));
+}
+
+
+/* Whether the next frame is to be skipped */
+static inline bool FrameSkip_Decide(const FrameSkip *skip)
+{
+    switch (skip->policy) {
+    case FrameSkipPolicy_Auto:
+        return ((skip->debt_ns > 0) && (skip->run < skip->max));
+    case FrameSkipPolicy_Fixed:
+        return (skip->run < skip->max);
+    default:
+        return false;
+    }
+}
+
+
+/* Accounts for a frame that kept the runner for ns */
+static void FrameSkip_Account(FrameSkip *skip, bool skipped, uint64_t ns)
+{
+    if (skipped) {
+        skip->run += 1;
+        skip->skipped += 1;
+    }
+    else {
+        skip->run = 0;
+        skip->shown += 1;
+    }
+
+    /* A long stall, like loading, would otherwise be paid for with many
+       seconds of skipping */
+    skip->debt_ns += (int64_t) ns - skip->budget_ns;
+    if (skip->debt_ns < 0) {
+        skip->debt_ns = 0;
+    }
+    else if (skip->debt_ns > (4 * skip->budget_ns)) {
+        skip->debt_ns = 4 * skip->budget_ns;
+    }
+}
+
+
+/* ************************************************************************ */
+/* Instrumentation
+/* ************************************************************************ */
+
+/* When enabled, the time spent in each phase of every frame is recorded into
+   a fixed-bucket histogram per phase.  Each phase is only ever recorded by
+   one thread, so recording needs no synchronization. */
+typedef enum ProfilePhase
+{
+    /* Runner thread: MAME emulating, excluding the callbacks below */
+    ProfilePhase_Emulate,
+    /* Runner thread: UpdateVideoCb() */
+    ProfilePhase_Video,
+    /* Runner thread: UpdateAudioCb() */
+    ProfilePhase_Audio,
+    /* Runner thread: waiting for retro_run() to ask for the next frame */
+    ProfilePhase_RunnerWait,
+    /* Frontend thread: waiting in retro_run() for the runner */
+    ProfilePhase_FrontendWait,
+    /* Frontend thread: handing video and audio to the frontend */
+    ProfilePhase_Deliver,
+    /* Frontend thread: all of retro_run() */
+    ProfilePhase_Frame,
+    ProfilePhase_Count
+} ProfilePhase;
+
+static const char *profilePhaseNamesG[ProfilePhase_Count] =
+{
+    "emulate", "video", "audio", "runner wait", "frontend wait", "deliver",
+    "frame"
+};
+
+/* Buckets are in microseconds: exact below 16us, then four buckets per
+   power of two, which reaches well past a second */
+#define PROFILE_LINEAR_BUCKETS 16
+#define PROFILE_BUCKETS (PROFILE_LINEAR_BUCKETS + (4 * 24))
+
+typedef struct ProfileHistogram
+{
+    uint64_t counts[PROFILE_BUCKETS];
+    uint64_t total;
+    uint64_t max_ns;
+} ProfileHistogram;
+
+static bool profileEnabledG;
+/* Dump every this many frames; 0 dumps only when the game is unloaded */
+static unsigned int profileIntervalG;
+static ProfileHistogram profileHistogramsG[ProfilePhase_Count];
+/* Runner thread bookkeeping for the emulate phase */
+static uint64_t profileResumeNsG, profileCallbacksNsG;
+
+
+static inline uint64_t Profile_Now()
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+
+static unsigned int Profile_Bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    if (us < PROFILE_LINEAR_BUCKETS) {
+        return (unsigned int) us;
+    }
+
+    unsigned int log2 = 63 - __builtin_clzll(us);
+    unsigned int sub = (unsigned int) ((us >> (log2 - 2)) & 3);
+    unsigned int bucket = PROFILE_LINEAR_BUCKETS + ((log2 - 4) * 4) + sub;
+
+    return (bucket < PROFILE_BUCKETS) ? bucket : (PROFILE_BUCKETS - 1);
+}
+
+
+/* The largest value, in microseconds, that lands in a bucket */
+static uint64_t Profile_BucketLimit(unsigned int bucket)
+{
+    if (bucket < PROFILE_LINEAR_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned int log2 = ((bucket - PROFILE_LINEAR_BUCKETS) / 4) + 4;
+    unsigned int sub = (bucket - PROFILE_LINEAR_BUCKETS) % 4;
+
+    return ((4ull + sub + 1) << (log2 - 2)) - 1;
+}
+
+
+/* Returns a start time for Profile_End(), or 0 if profiling is off */
+static inline uint64_t Profile_Begin()
+{
+    return profileEnabledG ? Profile_Now() : 0;
+}
+
+
+static void Profile_Record(ProfilePhase phase, uint64_t ns)
+{
+    ProfileHistogram *h = &(profileHistogramsG[phase]);
+
+    h->counts[Profile_Bucket(ns)] += 1;
+    h->total += 1;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+}
+
+
+/* Records the time since start against phase and returns it */
+static inline uint64_t Profile_End(ProfilePhase phase, uint64_t start)
+{
+    if (!profileEnabledG) {
+        return 0;
+    }
+
+    uint64_t ns = Profile_Now() - start;
+    Profile_Record(phase, ns);
+
+    return ns;
+}
+
+
+static uint64_t Profile_Percentile(const ProfileHistogram *h, unsigned int pct)
+{
+    uint64_t threshold = ((h->total * pct) + 99) / 100, seen = 0;
+
+    for (unsigned int i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen && (seen >= threshold)) {
+            return Profile_BucketLimit(i);
+        }
+    }
+
+    return 0;
+}
+
+
+static void Profile_Dump(const char *when)
+{
+    if (!profileEnabledG) {
+        return;
+    }
+
+    Log_Printf(LogLevel_Info, "Frame profile (%s):\n", when);
+    for (int i = 0; i < ProfilePhase_Count; i++) {
+        const ProfileHistogram *h = &(profileHistogramsG[i]);
+        if (!h->total) {
+            continue;
+        }
+        Log_Printf(LogLevel_Info,
+                   "  %-14s n=%-8llu p50<=%lluus p99<=%lluus max=%lluus\n",
+                   profilePhaseNamesG[i], (unsigned long long) h->total,
+                   (unsigned long long) Profile_Percentile(h, 50),
+                   (unsigned long long) Profile_Percentile(h, 99),
+                   (unsigned long long) (h->max_ns / 1000));
+    }
+
+    const AudioRingStats *a = &(audioRingG.stats);
+    if (a->fill_count) {
+        Log_Printf(LogLevel_Info,
+                   "  %-14s delivered=%llu dropped=%llu partial=%llu "
+                   "empty=%llu fill min/avg/max=%u/%llu/%u frames\n",
+                   "audio ring", (unsigned long long) a->delivered,
+                   (unsigned long long) a->dropped,
+                   (unsigned long long) a->partial_writes,
+                   (unsigned long long) a->empty_drains, a->fill_min,
+                   (unsigned long long) (a->fill_sum / a->fill_count),
+                   a->fill_max);
+    }
+
+    const FrameSkip *skip = &frameSkipG;
+    if (skip->policy != FrameSkipPolicy_Disabled) {
+        Log_Printf(LogLevel_Info, "  %-14s shown=%llu skipped=%llu\n",
+                   "frame skip", (unsigned long long) skip->shown,
+                   (unsigned long long) skip->skipped);
+    }
+
+    const LogRing *log = &logRingG;
+    uint64_t posted = 0, dropped = 0;
+    for (int i = 0; i < LogLevel_Count; i++) {
+        posted += log->posted[i];
+        dropped += log->dropped[i];
+    }
+    Log_Printf(LogLevel_Info, "  %-14s posted=%llu dropped=%llu\n",
+               "log ring", (unsigned long long) posted,
+               (unsigned long long) dropped);
+}
+
+
+static void Profile_Reset()
+{
+    memset(profileHistogramsG, 0, sizeof(profileHistogramsG));
+    profileResumeNsG = profileCallbacksNsG = 0;
+    AudioRing_ResetStats(&audioRingG);
+}
+
+
+/* ************************************************************************ */
+/* Core options
+/* ************************************************************************ */
+
+static const struct retro_variable coreVariablesG[] =
+{
+    { "libretromame_performance",
+      "Performance profile; balanced|full-fidelity|low-power|custom" },
+    { "libretromame_sound",
+      "Sound (custom profile); enabled|disabled" },
+    { "libretromame_sample_rate",
+      "Sample rate (custom profile); 48000|44100|32000|22050|11025" },
+    { "libretromame_samples",
+      "Sampled sounds (custom profile); enabled|disabled" },
+    { "libretromame_artwork",
+      "Backdrops, overlays and bezels (custom profile); disabled|enabled" },
+    { "libretromame_vector_scale",
+      "Vector game resolution; 2x|1x|3x|4x" },
+    { "libretromame_pipelined",
+      "Pipelined runner (adds one frame of latency); disabled|enabled" },
+    { "libretromame_runner_cpu",
+      "Pin runner thread to CPU; disabled|0|1|2|3|4|5|6|7" },
+    { "libretromame_runner_realtime",
+      "Real time priority for runner thread; disabled|enabled" },
+    { "libretromame_frameskip",
+      "Frame skip; disabled|auto|fixed" },
+    { "libretromame_frameskip_max",
+      "Most frames skipped in a row; 2|1|3|4|6|9" },
+    { "libretromame_frameskip_threshold",
+      "Auto frame skip when emulation takes this % of a frame; "
+      "90|70|80|100|110" },
+    { "libretromame_run_ahead",
+      "Run-ahead frames, to cut input lag; 0|1|2|3|4" },
+    { "libretromame_rewind",
+      "Rewind; disabled|enabled" },
+    { "libretromame_rewind_button",
+      "Rewind button (player 1, taken from the game); L3|R3|L2|R2" },
+    { "libretromame_rewind_memory",
+      "Rewind memory limit in MB; 64|16|32|128|256" },
+    { "libretromame_rewind_interval",
+      "Frames between rewind states; 2|1|4|8|15|30" },
+    { "libretromame_rom_cache_size",
+      "ROM cache size limit in MB; 1024|256|512|2048|4096|unlimited" },
+    { "libretromame_log_level",
+      "Log messages from; info|debug|warning|error" },
+    { "libretromame_export",
+      "Shared memory export for encoders; disabled|enabled" },
+    { "libretromame_profile",
+      "Frame time profiling; disabled|enabled" },
+    { "libretromame_profile_interval",
+      "Frames between profile dumps; 0|600|3600|36000" },
+    { NULL, NULL }
+};
+
+
+/* Returns the frontend's value for a core option, or NULL if it has none */
+static const char *GetVariable(const char *key)
+{
+    struct retro_variable var = { key, NULL };
+
+    if (!retroEnvironmentG ||
+        !(retroEnvironmentG)(RETRO_ENVIRONMENT_GET_VARIABLE, &var)) {
+        return NULL;
+    }
+
+    return var.value;
+}
+
+
+static bool GetVariableEnabled(const char *key)
+{
+    const char *value = GetVariable(key);
+
+    return (value && !strcmp(value, "enabled"));
+}
+
+
+/* MAME settings that trade fidelity for speed.  Throttling and sleeping
+   are not among them: the frontend paces the core, so MAME never does. */
+typedef struct PerformanceProfile
+{
+    const char *name;
+    bool sound;
+    int sample_rate;
+    bool samples;
+    bool artwork;
+    /* The frame skip policy when the frame skip option is disabled */
+    const char *frameskip;
+} PerformanceProfile;
+
+static const PerformanceProfile performanceProfilesG[] =
+{
+    { "balanced", true, 48000, true, false, "disabled" },
+    { "full-fidelity", true, 48000, true, true, "disabled" },
+    { "low-power", true, 22050, false, false, "auto" }
+};
+
+
+/* Sets MAME's options from the performance profile, or for the custom
+   profile from the options of its own; returns the profile's frame skip
+   policy */
+static const char *ApplyPerformanceProfile(LibMame_RunGameOptions *options)
+{
+    const char *name = GetVariable("libretromame_performance");
+    PerformanceProfile custom = performanceProfilesG[0];
+    const PerformanceProfile *profile = &(performanceProfilesG[0]);
+
+    if (name && !strcmp(name, "custom")) {
+        const char *value = GetVariable("libretromame_sound");
+        custom.sound = !(value && !strcmp(value, "disabled"));
+        value = GetVariable("libretromame_sample_rate");
+        if (value && (atoi(value) > 0)) {
+            custom.sample_rate = atoi(value);
+        }
+        value = GetVariable("libretromame_samples");
+        custom.samples = !(value && !strcmp(value, "disabled"));
+        custom.artwork = GetVariableEnabled("libretromame_artwork");
+        profile = &custom;
+    }
+    else if (name) {
+        for (size_t i = 0; i < (sizeof(performanceProfilesG) /
+                                sizeof(performanceProfilesG[0])); i++) {
+            if (!strcmp(name, performanceProfilesG[i].name)) {
+                profile = &(performanceProfilesG[i]);
+            }
+        }
+    }
+
+    options->sound = profile->sound;
+    options->sample_rate = profile->sample_rate;
+    options->use_samples = profile->samples;
+    options->use_backdrops = profile->artwork;
+    options->use_overlays = profile->artwork;
+    options->use_bezels = profile->artwork;
+
+    return profile->frameskip;
+}
+
+
+/* ************************************************************************ */
+/* ************************************************************************ */
+
+
+void retro_set_environment(retro_environment_t r)
+{
+    retroEnvironmentG = r;
+
+    (void) (retroEnvironmentG)(RETRO_ENVIRONMENT_SET_VARIABLES,
+                               (void *) coreVariablesG);
+}
+
+
+void retro_set_video_refresh(retro_video_refresh_t r)
+{
+    retroVideoRefreshG = r;
+}
+
+
+void retro_set_audio_sample(retro_audio_sample_t r)
+{
+    retroAudioSampleG = r;
+}
+
+
+void retro_set_audio_sample_batch(retro_audio_sample_batch_t r)
+{
+    retroAudioSampleBatchG = r;
+}
+
+
+void retro_set_input_poll(retro_input_poll_t r)
+{
+    retroInputPollG = r;
+}
+
+
+void retro_set_input_state(retro_input_state_t r)
+{
+    retroInputStateG = r;
+}
+
+
+void retro_init()
+{
+    /* Before anything that might want to say something */
+    Log_Start(&logRingG);
+
+    /* retro_init() assumes success, so so will we */
+    (void) LibMame_Initialize();
+
+    Handoff_Initialize(&toRunnerG);
+    Handoff_Initialize(&fromRunnerG);
+    Handoff_Initialize(&(stateChannelG.done));
+    handoffSpinG = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+    /* Map the game metadata cache, building it on first use */
+    const char *directory = NULL;
+    if (retroEnvironmentG &&
+        !(retroEnvironmentG)(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY,
+                             &directory)) {
+        directory = NULL;
+    }
+    GameIndex_Open(&gameIndexG, directory);
+    romCacheDirectoryG[0] = 0;
+    if (directory) {
+        snprintf(romCacheDirectoryG, sizeof(romCacheDirectoryG), "%s/%s",
+                 directory, ROM_CACHE_DIRECTORY);
+    }
+
+    /* Pick the pixel conversion kernels for this CPU */
+    SelectConvertKernels();
+
+    /* The runner thread takes one CPU; help it out with the rest */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    WorkerPool_Create(&workerPoolG,
+                      (cpus > 1) ? ((unsigned int) cpus - 1) : 0);
+
+    /* Set up the libmame options */
+    LibMame_Get_Default_RunGameOptions(&runGameOptionsG);
+    runGameOptionsG.auto_frame_skip = 0;
+    runGameOptionsG.throttle = 0;
+    runGameOptionsG.sleep = 0;
+    runGameOptionsG.sound = 1;
+    runGameOptionsG.sample_rate = AUDIO_SAMPLE_RATE;
+    runGameOptionsG.skip_gameinfo_screens = 1;
+    runGameOptionsG.quiet_startup = 1;
+    runGameOptionsG.use_backdrops = 0;
+    runGameOptionsG.use_overlays = 0;
+    runGameOptionsG.use_bezels = 0;
+}
+
+
+void retro_deinit()
+{
+    /* Not going to bother to enforce that retro_init() has occurred
+       successfully */
+    Runner_Join(&runnerG);
+    Libmame_Deinitialize();
+
+    WorkerPool_Destroy(&workerPoolG);
+    GameIndex_Close(&gameIndexG);
+
+    Handoff_Destroy(&toRunnerG);
+    Handoff_Destroy(&fromRunnerG);
+    Handoff_Destroy(&(stateChannelG.done));
+
+    /* Last, so that everything said until now is written out */
+    Log_Stop(&logRingG);
+}
+
+
+unsigned int retro_api_version()
+{
+    return RETRO_API_VERSION;
+}
+
+
+void retro_get_system_info(struct retro_system_info *info)
+{
+    info->library_name = "libretromame";
+    info->library_version = LIBRARY_VERSION;
+    info->valid_extensions = "zip|ZIP|chd|CHD";
+    /* The zip is mapped into the ROM cache from its file, and CHDs are
+       read by MAME, so neither is wanted in memory */
+    info->need_fullpath = true;
+    info->block_extract = true;
+}
+
+
+void retro_get_system_av_info(struct retro_system_av_info *info)
+{
+    *info = avInfoG;
+}
+
+
+void retro_set_controller_port_device(unsigned port, unsigned device)
+{
+    /* Not sure what this is even supposed to do */
+    (void) port, (void) device;
+}
+
+
+void retro_reset()
+{
+    /* Picked up by the runner at the end of the frame it is emulating */
+    __atomic_store_n(&resetG, true, __ATOMIC_RELEASE);
+}
+
+
+size_t retro_serialize_size()
+{
+    /* The size has to stay the same for the whole game, so it is that of
+       the state buffer rather than of any one state */
+    if (!State_Prepare()) {
+        return 0;
+    }
+
+    return STATE_HEADER_SIZE + stateCapacityG;
+}
+
+
+bool retro_serialize(void *data, size_t size)
+{
+    if (!State_Save() || (size < (STATE_HEADER_SIZE + stateLengthG))) {
+        return false;
+    }
+
+    uint8_t *d = (uint8_t *) data;
+    uint32_t header[STATE_HEADER_SIZE / sizeof(uint32_t)] =
+        { STATE_MAGIC, 0, (uint32_t) stateLengthG, 0 };
+    memcpy(d, header, sizeof(header));
+    memcpy(d + STATE_HEADER_SIZE, stateDataG, stateLengthG);
+    memset(d + STATE_HEADER_SIZE + stateLengthG, 0,
+           size - STATE_HEADER_SIZE - stateLengthG);
+
+    return true;
+}
+
+
+bool retro_unserialize(const void *data, size_t size)
+{
+    const uint8_t *d = (const uint8_t *) data;
+    uint32_t header[STATE_HEADER_SIZE / sizeof(uint32_t)];
+
+    if (size < STATE_HEADER_SIZE) {
+        return false;
+    }
+    memcpy(header, d, sizeof(header));
+    if ((header[0] != STATE_MAGIC) ||
+        (header[2] > (size - STATE_HEADER_SIZE))) {
+        return false;
+    }
+
+    return State_Load(d + STATE_HEADER_SIZE, header[2]);
+}
+
+
+void retro_cheat_reset()
+{
+    /* Not supported yet */
+}
+
+
+void retro_cheat_set(unsigned index, bool enabled, const char *code)
+{
+    /* Not supported yet */
+    (void) index, (void) enabled, (void) code;
+}
+
+
+bool retro_load_game_special(unsigned int game_type,
+                             const struct retro_game_info *info,
+                             size_t num_info)
+{
+    /* Not supported yet */
+    (void) game_type, (void) info, (void) num_info;
+    return false;
+}
+
+
+bool retro_load_game(const struct retro_game_info *game)
+{
+    /* The rom path is the directory holding the file, and the game name is
+       the file name up to its first '.', folded to lower case */
+    const char *path = game->path;
+    if (!path) {
+        return false;
+    }
+    const char *base = path;
+    for (const char *c = path; *c; c++) {
+        if ((*c == '/') || (*c == '\\')) {
+            base = c + 1;
+        }
+    }
+    if (base > path) {
+        snprintf(runGameOptionsG.rom_path, sizeof(runGameOptionsG.rom_path),
+                 "%.*s", (int) (base - path - 1), path);
+    }
+    else {
+        /* local file */
+        snprintf(runGameOptionsG.rom_path, sizeof(runGameOptionsG.rom_path),
+                 ".");
+    }
+
+    char gamename[256];
+    size_t length = 0;
+    while (base[length] && (base[length] != '.') &&
+           (length < (sizeof(gamename) - 1))) {
+        gamename[length] = (char) tolower((unsigned char) base[length]);
+        length += 1;
+    }
+    gamename[length] = 0;
+
+    /* Look up the game */
+    runningGameNumberG = GameIndex_Find(&gameIndexG, gamename);
+
+    if (runningGameNumberG == -1) {
+        return false;
+    }
+
+    /* Have MAME find the set unpacked in the ROM cache, and anything else
+       (parent and BIOS sets) where it was before */
+    const char *cache_size = GetVariable("libretromame_rom_cache_size");
+    /* "unlimited" reads as 0 */
+    romCacheLimitG =
+        (uint64_t) (cache_size ? atoi(cache_size) : 1024) * 1024 * 1024;
+    char entry[ROM_CACHE_PATH_MAX];
+    if (RomCache_Prepare(gamename, game->data, game->size, path, entry,
+                         sizeof(entry))) {
+        char rom_path[sizeof(runGameOptionsG.rom_path)];
+        if (snprintf(rom_path, sizeof(rom_path), "%s;%s", entry,
+                     runGameOptionsG.rom_path) < (int) sizeof(rom_path)) {
+            memcpy(runGameOptionsG.rom_path, rom_path, sizeof(rom_path));
+        }
+    }
+
+    GameMetadata meta;
+    GameIndex_Get(&gameIndexG, runningGameNumberG, &meta);
+
+    /* Let the frontend warn about games that are too much for it */
+    unsigned int level = GameIndex_PerformanceLevel(runningGameNumberG);
+    if (retroEnvironmentG) {
+        (void) (retroEnvironmentG)(RETRO_ENVIRONMENT_SET_PERFORMANCE_LEVEL,
+                                   &level);
+    }
+
+    const char *frameskip = ApplyPerformanceProfile(&runGameOptionsG);
+
+    /* A vertical game is best rotated by the frontend, on its way to the
+       screen, which usually costs nothing; if MAME rotates, every frame is
+       transposed before the core sees it.  So MAME is only asked to rotate
+       when the frontend can't, and otherwise hands over the screen as the
+       game's hardware draws it, meta.width by meta.height.  The rotation is
+       set for every game, to undo that of a game played before. */
+    unsigned int rotation = GameIndex_Rotation(&meta);
+    bool rotated = (retroEnvironmentG &&
+                    (retroEnvironmentG)(RETRO_ENVIRONMENT_SET_ROTATION,
+                                        &rotation));
+    runGameOptionsG.rotate = !rotated;
+    if (!rotated && (rotation & 1)) {
+        uint16_t width = meta.width;
+        meta.width = meta.height;
+        meta.height = width;
+    }
+
+    /* The frontend asks for the AV info as soon as this returns, long
+       before MAME produces any video or audio; answer from the metadata
+       and from the sample rate MAME will be told to use */
+    memset(&avInfoG, 0, sizeof(avInfoG));
+    avInfoG.geometry.base_width = meta.width;
+    avInfoG.geometry.base_height = meta.height;
+    avInfoG.geometry.max_width = meta.width;
+    avInfoG.geometry.max_height = meta.height;
+    /* The aspect ratio is defined by the base_width and base_height, of the
+       frame as it is before the frontend rotates it */
+    avInfoG.geometry.aspect_ratio = 0.0;
+    avInfoG.timing.fps = meta.refresh_rate_hz;
+    avInfoG.timing.sample_rate = runGameOptionsG.sample_rate;
+
+    /* Vector games are drawn at a multiple of their native resolution */
+    Vector_Free(&vectorScreenG);
+    if ((meta.screen_type == LibMame_ScreenType_Vector) && meta.width &&
+        meta.height) {
+        const char *scale = GetVariable("libretromame_vector_scale");
+        Vector_Configure(&vectorScreenG, meta.width, meta.height,
+                         scale ? (uint32_t) atoi(scale) : 2);
+        avInfoG.geometry.base_width = vectorScreenG.width;
+        avInfoG.geometry.base_height = vectorScreenG.height;
+        avInfoG.geometry.max_width = vectorScreenG.width;
+        avInfoG.geometry.max_height = vectorScreenG.height;
+    }
+
+    /* Prefer 32 bit output, which MAME's palettes and RGB32 textures already
+       use; fall back to the libretro default if the frontend refuses */
+    enum retro_pixel_format format = RETRO_PIXEL_FORMAT_XRGB8888;
+    if (retroEnvironmentG &&
+        (retroEnvironmentG)(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format)) {
+        pixelFormatG = RETRO_PIXEL_FORMAT_XRGB8888;
+    }
+    else {
+        pixelFormatG = RETRO_PIXEL_FORMAT_0RGB1555;
+    }
+
+    canDupeG = false;
+    if (retroEnvironmentG &&
+        !(retroEnvironmentG)(RETRO_ENVIRONMENT_GET_CAN_DUPE, &canDupeG)) {
+        canDupeG = false;
+    }
+    lastFrameValidG = false;
+
+    /* While exporting, the frame arena is allocated in the export object,
+       so both start afresh with each game.  The object can also be named
+       from the environment, which turns exporting on. */
+    FrameArena_Free(&frameArenaG);
+    Export_Close(&exportG);
+    const char *export = getenv("LIBRETROMAME_EXPORT");
+    if ((export && *export) || GetVariableEnabled("libretromame_export")) {
+        char name[64];
+        if (!export || !*export) {
+            snprintf(name, sizeof(name), "/libretromame.%ld",
+                     (long) getpid());
+            export = name;
+        }
+        if (Export_Open(&exportG, export)) {
+            frameArenaG.exported = true;
+            frameArenaG.generations = exportG.header->generations;
+            Log_Printf(LogLevel_Info, "Exporting to %s\n", exportG.name);
+        }
+        else {
+            Log_Printf(LogLevel_Error, "Could not export to %s\n", export);
+        }
+    }
+
+    /* Size the frame arena for this game's screen; it grows later if the
+       game ever produces something bigger */
+    if (!FrameArena_Reserve(&frameArenaG, avInfoG.geometry.max_width,
+                            avInfoG.geometry.max_height)) {
+        runningGameNumberG = -1;
+        return false;
+    }
+
+    /* Clear the stop indicator, the frame handoff state and any leftover
+       audio */
+    runningGameStopG = false;
+    resetG = false;
+    Handoff_Open(&toRunnerG);
+    Handoff_Open(&fromRunnerG);
+    AudioRing_Reset(&audioRingG);
+    masterGainG = AUDIO_GAIN_UNITY;
+    pipelinedG = GetVariableEnabled("libretromame_pipelined");
+    const char *cpu = GetVariable("libretromame_runner_cpu");
+    runnerCpuG = (cpu && strcmp(cpu, "disabled")) ? atoi(cpu) : -1;
+    runnerRealtimeG = GetVariableEnabled("libretromame_runner_realtime");
+    stateChannelG.request = StateOp_None;
+    Handoff_Open(&(stateChannelG.done));
+    State_Configure(&runGameOptionsG);
+    rewindEnabledG = GetVariableEnabled("libretromame_rewind");
+    const char *memory = GetVariable("libretromame_rewind_memory");
+    rewindLimitG = (size_t) (memory ? atoi(memory) : 64) * 1024 * 1024;
+    const char *every = GetVariable("libretromame_rewind_interval");
+    rewindIntervalG = every ? (unsigned int) atoi(every) : 2;
+    rewindFramesG = 0;
+    const char *button = GetVariable("libretromame_rewind_button");
+    rewindButtonG =
+        !rewindEnabledG ? -1 :
+        (button && !strcmp(button, "R3")) ? RETRO_DEVICE_ID_JOYPAD_R3 :
+        (button && !strcmp(button, "L2")) ? RETRO_DEVICE_ID_JOYPAD_L2 :
+        (button && !strcmp(button, "R2")) ? RETRO_DEVICE_ID_JOYPAD_R2 :
+        RETRO_DEVICE_ID_JOYPAD_L3;
+    InputPlan_Build(&meta);
+    /* Running ahead needs the runner to stay in step with retro_run() */
+    const char *ahead = GetVariable("libretromame_run_ahead");
+    runAheadFramesG = (ahead && !pipelinedG) ? (unsigned int) atoi(ahead) : 0;
+    frameFlagsG = 0;
+    const char *policy = GetVariable("libretromame_frameskip");
+    if (!policy || !strcmp(policy, "disabled")) {
+        policy = frameskip;
+    }
+    /* Skipping frames needs the runner in step with retro_run() too */
+    FrameSkip_Configure(&frameSkipG, pipelinedG ? NULL : policy,
+                        GetVariable("libretromame_frameskip_max"),
+                        GetVariable("libretromame_frameskip_threshold"),
+                        avInfoG.timing.fps);
+
+    /* Profiling can also be forced on from the environment, for places
+       where the frontend's options are out of reach */
+    const char *profile = getenv("LIBRETROMAME_PROFILE");
+    profileEnabledG = (GetVariableEnabled("libretromame_profile") ||
+                       (profile && strcmp(profile, "0")));
+    const char *interval = getenv("LIBRETROMAME_PROFILE_INTERVAL");
+    if (!interval) {
+        interval = GetVariable("libretromame_profile_interval");
+    }
+    profileIntervalG = interval ? (unsigned int) atoi(interval) : 0;
+    const char *log_level = GetVariable("libretromame_log_level");
+    logRingG.min_level =
+        !log_level ? LogLevel_Info :
+        !strcmp(log_level, "debug") ? LogLevel_Debug :
+        !strcmp(log_level, "warning") ? LogLevel_Warning :
+        !strcmp(log_level, "error") ? LogLevel_Error : LogLevel_Info;
+    Profile_Reset();
+
+    /* Hand the game to the runner thread */
+    if (!Runner_Start(&runnerG)) {
+        runningGameNumberG = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Hands one finished frame's video to the frontend */
+static void DeliverFrameSlot(FrameSlot *slot)
+{
+    if (slot->video_valid) {
+        /* This libretro API has no way to tell the frontend about a change
+           of resolution after load, and frontends only ask for the AV info
+           then; keeping it up to date only serves anything that asks
+           again later.  Each frame carries its own size regardless. */
+        struct retro_game_geometry *geometry = &(avInfoG.geometry);
+        if ((slot->video.width != geometry->base_width) ||
+            (slot->video.height != geometry->base_height)) {
+            geometry->base_width = slot->video.width;
+            geometry->base_height = slot->video.height;
+            if (geometry->base_width > geometry->max_width) {
+                geometry->max_width = geometry->base_width;
+            }
+            if (geometry->base_height > geometry->max_height) {
+                geometry->max_height = geometry->base_height;
+            }
+        }
+        (retroVideoRefreshG)((slot->video_dupe && canDupeG) ?
+                             NULL : slot->video.data, slot->video.width,
+                             slot->video.height, slot->video.pitch);
+        deliveredVideoG = slot->video;
+        slot->video_valid = false;
+    }
+}
+
+
+/* Shows the last frame again, for a frame whose video was not made */
+static void DeliverDupe()
+{
+    if (canDupeG) {
+        (retroVideoRefreshG)(NULL, deliveredVideoG.width,
+                             deliveredVideoG.height, deliveredVideoG.pitch);
+    }
+    else if (deliveredVideoG.data && !deliveredVideoG.borrowed) {
+        /* Still there, as nothing has been converted since; a borrowed
+           texture may have been redrawn or freed by MAME, and is never
+           shown again */
+        (retroVideoRefreshG)(deliveredVideoG.data, deliveredVideoG.width,
+                             deliveredVideoG.height, deliveredVideoG.pitch);
+    }
+}
+
+
+/* Feeds a batch to a frontend that only has the single-sample callback, in
+   as tight a loop as an indirect call per frame allows */
+static size_t AudioSampleBatchFallback(const int16_t *data, size_t frames)
+{
+    retro_audio_sample_t sample = retroAudioSampleG;
+    const int16_t *end = data + (2 * frames);
+
+    while (data != end) {
+        (sample)(data[0], data[1]);
+        data += 2;
+    }
+
+    return frames;
+}
+
+
+/* Hands the frontend the audio in the ring, or as much of it as it will
+   take; the rest waits for the next call.  The batch callback is preferred
+   whenever the frontend has one. */
+static void DeliverAudio()
+{
+    AudioRing *ring = &audioRingG;
+    AudioRingStats *stats = &(ring->stats);
+    uint32_t fill = AudioRing_Fill(ring);
+    retro_audio_sample_batch_t batch = retroAudioSampleBatchG;
+
+    if (!batch && retroAudioSampleG) {
+        batch = &AudioSampleBatchFallback;
+    }
+
+    if (!fill && runningGameSampleRateG) {
+        stats->empty_drains += 1;
+    }
+
+    /* Only what is there now; in pipelined mode the runner may be adding
+       the next frame's samples meanwhile */
+    while (fill) {
+        const int16_t *samples;
+        uint32_t frames = AudioRing_Peek(ring, fill, &samples);
+        /* With nowhere to send it the audio is just discarded */
+        size_t accepted = batch ? (batch)(samples, frames) : frames;
+        accepted = (accepted < frames) ? accepted : frames;
+
+        AudioRing_Consume(ring, (uint32_t) accepted);
+        stats->delivered += accepted;
+        fill -= (uint32_t) accepted;
+        if (accepted < frames) {
+            stats->partial_writes += 1;
+            break;
+        }
+    }
+
+    fill = AudioRing_Fill(ring);
+    stats->fill_sum += fill;
+    stats->fill_count += 1;
+    stats->fill_min = (fill < stats->fill_min) ? fill : stats->fill_min;
+    stats->fill_max = (fill > stats->fill_max) ? fill : stats->fill_max;
+}
+
+
+/* Has the runner emulate one frame, with flags saying what to hide, and
+   presents whatever of it isn't hidden along with the audio so far;
+   returns the frame's number */
+static uint32_t RunFrame(uint32_t flags)
+{
+    frameFlagsG = flags;
+
+    /* Signal the runner thread to continue for one frame */
+    uint32_t frame = Handoff_Sequence(&toRunnerG) + 1;
+    Handoff_Post(&toRunnerG);
+
+    /* Wait until it signals that the frame is done; in pipelined mode it
+       normally already is, and the runner is busy with the next one */
+    uint64_t wait = Profile_Now();
+    bool done = Handoff_Wait(&fromRunnerG, frame);
+    uint64_t waited = Profile_Now() - wait;
+    frameWaitNsG += waited;
+    if (profileEnabledG) {
+        Profile_Record(ProfilePhase_FrontendWait, waited);
+    }
+
+    /* Present the frame that it produced, then flush the audio so far; the
+       audio goes last as the frontend may block in it on its audio driver */
+    if (done && (flags != (FRAME_HIDE_VIDEO | FRAME_HIDE_AUDIO))) {
+        uint64_t deliver = Profile_Begin();
+        if (!(flags & FRAME_HIDE_VIDEO)) {
+            DeliverFrameSlot(&(frameSlotsG[frame % FRAME_SLOTS]));
+        }
+        DeliverAudio();
+        (void) Profile_End(ProfilePhase_Deliver, deliver);
+    }
+
+    return frame;
+}
+
+
+/* Emulates the frame that counts, with its audio but not its video; then
+   runs ahead, showing the last frame but playing none; then takes the
+   frames ahead back.  The frame shown is thus the one the input would
+   have produced runAheadFramesG frames from now, which hides that much of
+   the game's own input lag.  A skipped frame shows nothing new. */
+static uint32_t RunAhead(bool skip)
+{
+    uint32_t frame = RunFrame(FRAME_HIDE_VIDEO);
+
+    if (!State_Checkpoint()) {
+        /* Without states there is no taking frames back; show the last
+           frame again, unless the caller does so for a skipped frame, and
+           stop trying */
+        runAheadFramesG = 0;
+        Log_Printf(LogLevel_Warning, "Run-ahead failed to save a state; "
+                   "running ahead is off\n");
+        if (!skip) {
+            DeliverDupe();
+        }
+        return frame;
+    }
+
+    for (unsigned int i = 1; i < runAheadFramesG; i++) {
+        (void) RunFrame(FRAME_HIDE_VIDEO | FRAME_HIDE_AUDIO);
+    }
+    (void) RunFrame(FRAME_HIDE_AUDIO | (skip ? FRAME_HIDE_VIDEO : 0));
+
+    /* If the game can't be taken back, it stays ahead; running ahead again
+       would only take it further */
+    if (!State_Restore()) {
+        runAheadFramesG = 0;
+        Log_Printf(LogLevel_Warning, "Run-ahead failed to restore its "
+                   "state; running ahead is off\n");
+    }
+    frameFlagsG = 0;
+
+    return frame;
+}
+
+
+void retro_run()
+{
+    uint64_t start = Profile_Begin();
+
+    /* Input must be read on the frontend's thread; the runner picks up the
+       latched state when MAME polls */
+    if (retroInputPollG) {
+        (retroInputPollG)();
+    }
+    if (retroInputStateG) {
+        LibMame_AllControlsState controls;
+        InputPlan_Evaluate(&controls);
+        InputLatch_Publish(&inputLatchG, &controls);
+    }
+
+    /* Holding the rewind button takes the game back a state each frame */
+    bool rewinding = (rewindEnabledG && retroInputStateG &&
+                      (retroInputStateG)(0, RETRO_DEVICE_JOYPAD, 0,
+                                         (unsigned) rewindButtonG));
+    if (rewinding) {
+        Rewind_Step(&rewindRingG);
+    }
+
+    /* A skipped frame is emulated, and its audio played, but its video is
+       neither converted nor presented.  A game whose frames go out without
+       conversion is never skipped: that would save nothing, and the last
+       frame is no longer there to be shown again. */
+    bool skip = (!deliveredVideoG.borrowed &&
+                 FrameSkip_Decide(&frameSkipG));
+    frameWaitNsG = 0;
+    Log_ShowNotice(&logRingG);
+
+    uint32_t frame = runAheadFramesG ? RunAhead(skip) :
+        RunFrame(skip ? FRAME_HIDE_VIDEO : 0);
+    if (skip) {
+        DeliverDupe();
     }
+    FrameSkip_Account(&frameSkipG, skip, frameWaitNsG);
+
+    if (rewindEnabledG && !rewinding &&
+        (++rewindFramesG >= rewindIntervalG)) {
+        rewindFramesG = 0;
+        Rewind_Capture(&rewindRingG);
+    }
+
+    (void) Profile_End(ProfilePhase_Frame, start);
+
+    if (profileIntervalG && !(frame % profileIntervalG)) {
+        Profile_Dump("periodic");
+    }
+}
+
+
+void retro_unload_game()
+{
+    /* Stop the game; the runner thread parks until the next one */
+    Runner_Stop(&runnerG);
+
+    Profile_Dump("unload");
+    profileEnabledG = false;
+
+    /* Reset game-related values */
+    runningGameWidthG = runningGameHeightG = 0;
+    runningGameSampleRateG = 0;
+    memset(&avInfoG, 0, sizeof(avInfoG));
+    memset(frameSlotsG, 0, sizeof(frameSlotsG));
+    memset(&deliveredVideoG, 0, sizeof(deliveredVideoG));
+    FrameArena_Free(&frameArenaG);
+    Export_Close(&exportG);
+    Compositor_Free(&compositorG);
+    Vector_Free(&vectorScreenG);
+    Rewind_Free(&rewindRingG);
+    State_Free();
+}
+
+
+unsigned int retro_get_region()
+{
+    /* Not supported yet */
+    return 0;
+}
+
+
+void *retro_get_memory_data(unsigned id)
+{
+    /* Not supported yet */
+    (void) id;
+    return NULL;
+}
+
+
+size_t retro_get_memory_size(unsigned id)
+{
+    /* Not supported yet */
+    return 0;
+}
+
+
+static void StatusTextCb(const char *format, va_list args, void *callback_data)
+{
+    (void) callback_data;
+
+    Log_VPrintf(LogLevel_Info, format, args);
+}
+
+
+static void StartingUpCb(LibMame_StartupPhase phase, int pct_complete,
+                         LibMame_RunningGame *running_game,
+                         void *callback_data)
+{
+    (void) callback_data;
+
+    runningGameG = running_game;
     
-    /* This should never happen; but if the texture is too big, ignore it */
-    if ((prim->texture.width * prim->texture.height) > (1000 * 1000)) {
+    const char *phase_name = "UNKNOWN";
+
+    switch (phase) {
+    case LibMame_StartupPhase_Preparing:
+        phase_name = "Preparing";
+        break;
+    case LibMame_StartupPhase_LoadingRoms:
+        phase_name = "Loading Roms";
+        break;
+    case LibMame_StartupPhase_InitializingMachine:
+        phase_name = "Initializing Machine";
+        break;
+    }
+
+    Log_Printf(LogLevel_Info, "Starting up: %s: %s - %d%%\n",
+               LibMame_GetGame_Full_Name(runningGameNumberG), phase_name,
+               pct_complete);
+}
+
+
+static void PollAllControlsStateCb(LibMame_AllControlsState *all_states,
+                                   void *callback_data)
+{
+    (void) callback_data;
+
+    if (!retroInputStateG) {
         return;
     }
 
-    runningGameWidthG = prim->texture.width;
-    runningGameHeightG = prim->texture.height;
+    /* retro_run() has already read the controls that the game uses */
+    InputLatch_Read(&inputLatchG, all_states);
+}
 
-    switch (LIBMAME_RENDERFLAGS_TEXTURE_FORMAT(prim.flags)) {
-    case LibMame_TextureFormat_Palette16:
-    case LibMame_TextureFormat_PaletteA16: {
-        /* Convert */
-        uint16_t *dest = videoFrameG;
-        uint16_t *src = (uint16_t *) prim->texture.base;
-        int rowdiff = prim->texture.rowpixels - prim->texture.width;
-        for (uint32_t y = 0; y < prim->texture.height; y++) {
-            for (uint32_t x = 0; x < prim>texture.width; x++) {
-                *dest++ = prim.texture.palette[*src++];
-            }
-            src += rowdiff;
+
+/* Returns the slot that the frame currently being emulated goes into; only
+   called on the runner thread, which is the only poster of fromRunnerG */
+static FrameSlot *RunnerFrameSlot()
+{
+    return &(frameSlotsG[(Handoff_Sequence(&fromRunnerG) + 1) % FRAME_SLOTS]);
+}
+
+
+/* The rows of one texture being hashed or converted, shared with the
+   worker pool */
+typedef struct TextureJob
+{
+    const LibMame_RenderPrimitive *prim;
+    size_t srcbytes;
+    /* Whether the source pixels are palette indices */
+    bool indexed;
+    /* Hashes of the source rows */
+    uint64_t *rows;
+    /* Largest palette index in each stripe, when hashing Palette16 */
+    uint16_t max[WORKER_POOL_MAX_STRIPES];
+    /* When converting: the destination, and the hashes of the source rows
+       it already holds, which are only trusted if reuse is set */
+    ConvertRowFn convert;
+    uint8_t *frame;
+    size_t pitch;
+    uint64_t *converted;
+    bool reuse;
+} TextureJob;
+
+
+static void HashTextureRows(void *arg, unsigned int stripe, uint32_t first,
+                            uint32_t last)
+{
+    TextureJob *job = (TextureJob *) arg;
+    const LibMame_RenderPrimitive *prim = job->prim;
+    size_t srcpitch = job->srcbytes * prim->texture.rowpixels;
+    size_t rowbytes = job->srcbytes * prim->texture.width;
+    const uint8_t *src = ((const uint8_t *) prim->texture.base) +
+        (first * srcpitch);
+    uint16_t max = 0;
+
+    for (uint32_t y = first; y < last; y++) {
+        job->rows[y] = (convertKernelsG.hash)(src, rowbytes, 0);
+        if (job->indexed) {
+            uint16_t rowmax = (convertKernelsG.max16)
+                ((const uint16_t *) src, prim->texture.width);
+            max = (rowmax > max) ? rowmax : max;
         }
-        break;
+        src += srcpitch;
     }
-        
-    case LibMame_TextureFormat_RGB32:
-    case LibMame_TextureFormat_ARGB32:{
-        /* Convert */
-        uint16_t *dest = videoFrameG;
-        uint32_t *src = (uint32_t *) prim->texture.base;
-        int rowdiff = prim->texture.rowpixels - prim->texture.width;
-        for (uint32_t y = 0; y < prim->texture.height; y++) {
-            for (uint32_t x = 0; x < prim>texture.width; x++) {
-                uint32_t xrgb = prim.texture.palette[*src++];
-                *dest++ = ((((xrgb >> 16) & 0x3f) << 10) |
-                           (((xrgb >>  8) & 0x3f) <<  5) |
-                           (((xrgb >>  0) & 0x3f) <<  0));
-            }
-            src += rowdiff;
+
+    job->max[stripe] = max;
+}
+
+
+/* Converts the rows of the texture whose source differs from what the
+   destination already holds */
+static void ConvertTextureRows(void *arg, unsigned int stripe, uint32_t first,
+                               uint32_t last)
+{
+    TextureJob *job = (TextureJob *) arg;
+    const LibMame_RenderPrimitive *prim = job->prim;
+    size_t srcpitch = job->srcbytes * prim->texture.rowpixels;
+    const uint8_t *src = ((const uint8_t *) prim->texture.base) +
+        (first * srcpitch);
+    uint8_t *dest = job->frame + (first * job->pitch);
+
+    (void) stripe;
+
+    /* Convert a row at a time with the best kernel for this CPU */
+    for (uint32_t y = first; y < last; y++) {
+        if (!job->reuse || (job->converted[y] != job->rows[y])) {
+            (job->convert)(dest, src, prim->texture.palette,
+                           prim->texture.width);
+            job->converted[y] = job->rows[y];
         }
-        break;
+        dest += job->pitch;
+        src += srcpitch;
+    }
+}
+
+
+/* Hashes each row of a texture into job->rows, and the whole texture,
+   together with the palette entries it uses, into key; returns the hash of
+   just the palette entries */
+static uint64_t HashTexture(TextureJob *job, LibMame_TextureFormat format,
+                            FrameKey *key)
+{
+    const LibMame_RenderPrimitive *prim = job->prim;
+    uint64_t palette_hash = 0;
+    uint16_t max = 0;
+
+    memset(key, 0, sizeof(*key));
+
+    job->indexed = ((format == LibMame_TextureFormat_Palette16) ||
+                    (format == LibMame_TextureFormat_PaletteA16));
+    uint32_t stripes = WorkerPool_Run
+        (&workerPoolG, &HashTextureRows, job, prim->texture.height,
+         (size_t) prim->texture.width * prim->texture.height);
+    for (uint32_t i = 0; i < stripes; i++) {
+        max = (job->max[i] > max) ? job->max[i] : max;
+    }
+
+    /* The part of the palette that the texture actually refers to; for
+       RGB32 textures that is all three channel tables, and for YUY16 the
+       one for Y */
+    if (prim->texture.palette) {
+        size_t entries = job->indexed ? ((size_t) max + 1) :
+            (format == LibMame_TextureFormat_YUY16) ? 256 : (3 * 256);
+        palette_hash = (convertKernelsG.hash)
+            (prim->texture.palette, entries * sizeof(uint32_t), 1);
     }
+
+    key->hash = (convertKernelsG.hash)
+        (job->rows, prim->texture.height * sizeof(uint64_t), palette_hash);
+    key->width = prim->texture.width;
+    key->height = prim->texture.height;
+    key->format = format;
+
+    return palette_hash;
+}
+
+
+/* Finds the kernel converting rows of the given texture format to
+   pixelFormatG, and the size of its source pixels; returns false for formats
+   that cannot be converted */
+static bool TextureConverter(LibMame_TextureFormat format,
+                             ConvertRowFn *convert, size_t *srcbytes)
+{
+    switch (format) {
+    case LibMame_TextureFormat_Palette16:
+    case LibMame_TextureFormat_PaletteA16:
+        *convert = convertKernelsG.palette16[pixelFormatG];
+        *srcbytes = 2;
+        return true;
+    case LibMame_TextureFormat_RGB32:
+    case LibMame_TextureFormat_ARGB32:
+        *convert = convertKernelsG.rgb32[pixelFormatG];
+        *srcbytes = 4;
+        return true;
     case LibMame_TextureFormat_YUY16:
-        /* Unimplemented */
-        return;
+        *convert = convertKernelsG.yuy16[pixelFormatG];
+        *srcbytes = 2;
+        return true;
     case LibMame_TextureFormat_Undefined:
         /* Should never happen */
-        return;
+        return false;
     default:
         /* Should never happen */
+        return false;
+    }
+}
+
+
+/* Converts the texture of a screen primitive, which is in the given format,
+   into a frame slot */
+static void ConvertTexture(const LibMame_RenderPrimitive *prim,
+                           LibMame_TextureFormat format, FrameSlot *slot)
+{
+    runningGameWidthG = prim->texture.width;
+    runningGameHeightG = prim->texture.height;
+
+    TextureJob job;
+    ConvertRowFn convert;
+    size_t srcbytes;
+
+    if (!TextureConverter(format, &convert, &srcbytes)) {
+        return;
+    }
+
+    /* An RGB32 texture without lookup tables is already byte-for-byte the
+       XRGB8888 frame the frontend wants, so it can be handed over without
+       copying; the texture stays untouched until the runner is told to
+       continue, which is not true in pipelined mode.  An exported frame
+       has to be in the arena. */
+    bool zero_copy = ((srcbytes == 4) && !prim->texture.palette &&
+                      !pipelinedG && !frameArenaG.exported &&
+                      (pixelFormatG == RETRO_PIXEL_FORMAT_XRGB8888));
+
+    /* For a zero-copy frame there is nothing to save unless the frontend
+       can dupe */
+    FrameKey key;
+    uint64_t palette_hash = 0;
+    bool check = (!zero_copy || canDupeG);
+    if (check) {
+        if (!FrameArena_ReserveRows(&frameArenaG, runningGameHeightG)) {
+            return;
+        }
+        job.prim = prim;
+        job.srcbytes = srcbytes;
+        job.rows = FrameArena_RowHashes(&frameArenaG, FRAME_ARENA_BUFFERS);
+        palette_hash = HashTexture(&job, format, &key);
+        if (lastFrameValidG && !memcmp(&key, &lastFrameKeyG, sizeof(key))) {
+            slot->video = lastFrameG;
+            slot->video_dupe = true;
+            slot->video_valid = true;
+            return;
+        }
+    }
+
+    uint8_t *frame;
+    size_t pitch;
+
+    if (zero_copy) {
+        frame = (uint8_t *) prim->texture.base;
+        pitch = 4 * prim->texture.rowpixels;
+    }
+    else {
+        uint8_t *base = frameArenaG.base;
+        if (!FrameArena_Reserve(&frameArenaG, runningGameWidthG,
+                                runningGameHeightG)) {
+            return;
+        }
+        /* Growing the arena frees the buffer the last frame was in */
+        if (frameArenaG.base != base) {
+            lastFrameValidG = false;
+        }
+
+        pitch = FrameArena_Pitch(runningGameWidthG);
+        unsigned int buffer = frameArenaG.next;
+        frame = (uint8_t *) FrameArena_Next(&frameArenaG);
+
+        /* The buffer still holds the frame from FRAME_ARENA_BUFFERS frames
+           ago; if that was converted from the same kind of texture with the
+           same palette, only the rows whose source has changed since need
+           converting */
+        FrameArenaContents *contents = &(frameArenaG.contents[buffer]);
+        job.reuse = (contents->valid &&
+                     (contents->palette_hash == palette_hash) &&
+                     (contents->width == runningGameWidthG) &&
+                     (contents->format == format) &&
+                     (contents->pitch == pitch));
+        job.convert = convert;
+        job.frame = frame;
+        job.pitch = pitch;
+        job.converted = FrameArena_RowHashes(&frameArenaG, buffer);
+
+        (void) WorkerPool_Run
+            (&workerPoolG, &ConvertTextureRows, &job, prim->texture.height,
+             (size_t) prim->texture.width * prim->texture.height);
+
+        contents->palette_hash = palette_hash;
+        contents->width = runningGameWidthG;
+        contents->format = format;
+        contents->pitch = pitch;
+        contents->valid = true;
+    }
+
+    slot->video.data = frame;
+    slot->video.width = runningGameWidthG;
+    slot->video.height = runningGameHeightG;
+    slot->video.pitch = pitch;
+    slot->video.borrowed = zero_copy;
+    slot->video_dupe = false;
+    slot->video_valid = true;
+
+    lastFrameG = slot->video;
+    lastFrameKeyG = key;
+    lastFrameValidG = check;
+}
+
+
+/* One screen being drawn into a composited frame, shared with the worker
+   pool */
+typedef struct CompositeJob
+{
+    const LibMame_RenderPrimitive *prim;
+    const CompositorScreen *screen;
+    ConvertRowFn convert;
+    size_t srcbytes;
+    uint8_t *frame;
+    size_t pitch;
+} CompositeJob;
+
+
+/* Draws destination rows first to last of a screen */
+static void CompositeScreenRows(void *arg, unsigned int stripe,
+                                uint32_t first, uint32_t last)
+{
+    CompositeJob *job = (CompositeJob *) arg;
+    const LibMame_RenderPrimitive *prim = job->prim;
+    const CompositorScreen *screen = job->screen;
+    size_t bytes = PIXEL_FORMAT_BYTES(pixelFormatG);
+    size_t srcpitch = job->srcbytes * prim->texture.rowpixels;
+    uint8_t *scratch = compositorG.scratch +
+        (stripe * compositorG.scratch_pitch);
+    uint8_t *dest = job->frame + ((screen->y + first) * job->pitch) +
+        (screen->x * bytes);
+    ScaleRowFn scale = convertKernelsG.scale[pixelFormatG];
+
+    for (uint32_t y = first; y < last; y++) {
+        uint32_t sy = screen->row_map[y];
+        if ((y > first) && (sy == screen->row_map[y - 1])) {
+            /* Stretched vertically; same as the row above */
+            memcpy(dest, dest - job->pitch, screen->width * bytes);
+        }
+        else {
+            const uint8_t *src = ((const uint8_t *) prim->texture.base) +
+                (sy * srcpitch);
+            if (screen->column_map) {
+                (job->convert)(scratch, src, prim->texture.palette,
+                               prim->texture.width);
+                (scale)(dest, scratch, screen->column_map, screen->width);
+            }
+            else {
+                (job->convert)(dest, src, prim->texture.palette,
+                               prim->texture.width);
+            }
+        }
+        dest += job->pitch;
+    }
+}
+
+
+/* Composites several screen quads into the frame slot being produced */
+static void CompositeScreens(const LibMame_RenderPrimitive **prims,
+                             unsigned int count, FrameSlot *slot)
+{
+    Compositor *c = &compositorG;
+
+    if (!Compositor_Layout(c, prims, count)) {
+        return;
+    }
+
+    runningGameWidthG = c->width;
+    runningGameHeightG = c->height;
+
+    /* The frame is identified by the combination of its screens */
+    FrameKey keys[COMPOSITOR_MAX_SCREENS];
+    uint32_t max_height = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (prims[i]->texture.height > max_height) {
+            max_height = prims[i]->texture.height;
+        }
+    }
+    if (!FrameArena_ReserveRows(&frameArenaG, max_height)) {
+        return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        TextureJob job;
+        ConvertRowFn convert;
+        if (!TextureConverter(c->screens[i].format, &convert,
+                              &(job.srcbytes))) {
+            /* Screens that cannot be drawn are left black */
+            memset(&(keys[i]), 0, sizeof(keys[i]));
+            continue;
+        }
+        job.prim = prims[i];
+        job.rows = FrameArena_RowHashes(&frameArenaG, FRAME_ARENA_BUFFERS);
+        (void) HashTexture(&job, c->screens[i].format, &(keys[i]));
+    }
+
+    FrameKey key;
+    memset(&key, 0, sizeof(key));
+    key.hash = (convertKernelsG.hash)(keys, count * sizeof(keys[0]),
+                                      c->layout);
+    key.width = c->width;
+    key.height = c->height;
+    key.format = LibMame_TextureFormat_Undefined;
+    if (lastFrameValidG && !memcmp(&key, &lastFrameKeyG, sizeof(key))) {
+        slot->video = lastFrameG;
+        slot->video_dupe = true;
+        slot->video_valid = true;
+        return;
+    }
+
+    uint8_t *base = frameArenaG.base;
+    if (!FrameArena_Reserve(&frameArenaG, c->width, c->height)) {
+        return;
+    }
+    if (frameArenaG.base != base) {
+        lastFrameValidG = false;
+    }
+
+    size_t pitch = FrameArena_Pitch(c->width);
+    unsigned int buffer = frameArenaG.next;
+    uint8_t *frame = (uint8_t *) FrameArena_Next(&frameArenaG);
+
+    /* A buffer that does not hold this layout is cleared, as the screens
+       need not cover the whole frame; otherwise only the screens that have
+       changed since it was last drawn into need drawing */
+    FrameArenaContents *contents = &(frameArenaG.contents[buffer]);
+    if (!contents->valid || (contents->palette_hash != c->layout) ||
+        (contents->format != LibMame_TextureFormat_Undefined) ||
+        (contents->width != c->width) || (contents->pitch != pitch)) {
+        memset(frame, 0, pitch * c->height);
+        memset(c->drawn[buffer], 0, sizeof(c->drawn[buffer]));
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (!memcmp(&(keys[i]), &(c->drawn[buffer][i]), sizeof(keys[i]))) {
+            continue;
+        }
+        CompositeJob job;
+        job.prim = prims[i];
+        job.screen = &(c->screens[i]);
+        job.frame = frame;
+        job.pitch = pitch;
+        if (!TextureConverter(job.screen->format, &(job.convert),
+                              &(job.srcbytes))) {
+            continue;
+        }
+        (void) WorkerPool_Run
+            (&workerPoolG, &CompositeScreenRows, &job, job.screen->height,
+             (size_t) job.screen->width * job.screen->height);
+        c->drawn[buffer][i] = keys[i];
+    }
+
+    contents->palette_hash = c->layout;
+    contents->width = c->width;
+    contents->format = LibMame_TextureFormat_Undefined;
+    contents->pitch = pitch;
+    contents->valid = true;
+
+    slot->video.data = frame;
+    slot->video.width = c->width;
+    slot->video.height = c->height;
+    slot->video.pitch = pitch;
+    slot->video.borrowed = false;
+    slot->video_dupe = false;
+    slot->video_valid = true;
+
+    lastFrameG = slot->video;
+    lastFrameKeyG = key;
+    lastFrameValidG = true;
+}
+
+
+/* Draws the lines of a vector screen into the frame slot being produced */
+static void DrawVectors(const LibMame_RenderPrimitive *render_primitive_list,
+                        FrameSlot *slot)
+{
+    VectorScreen *v = &vectorScreenG;
+
+    if (!Vector_Reserve(v) || !Vector_Collect(v, render_primitive_list)) {
         return;
     }
 
-    (retroVideoRefreshG)(videoFrameG, runningGameWidthG, runningGameHeightG,
-                         2 * runningGameWidthG);
+    runningGameWidthG = v->width;
+    runningGameHeightG = v->height;
+
+    /* The frame is identified by its lines */
+    FrameKey key;
+    memset(&key, 0, sizeof(key));
+    key.hash = (convertKernelsG.hash)(v->lines, v->count * sizeof(VectorLine),
+                                      v->scale);
+    key.width = v->width;
+    key.height = v->height;
+    key.format = LibMame_TextureFormat_Undefined;
+    if (lastFrameValidG && !memcmp(&key, &lastFrameKeyG, sizeof(key))) {
+        slot->video = lastFrameG;
+        slot->video_dupe = true;
+        slot->video_valid = true;
+        return;
+    }
+
+    uint8_t *base = frameArenaG.base;
+    if (!FrameArena_Reserve(&frameArenaG, v->width, v->height)) {
+        return;
+    }
+    if (frameArenaG.base != base) {
+        lastFrameValidG = false;
+    }
+
+    size_t pitch = FrameArena_Pitch(v->width);
+    unsigned int buffer = frameArenaG.next;
+    uint8_t *frame = (uint8_t *) FrameArena_Next(&frameArenaG);
+
+    VectorJob job;
+    job.screen = v;
+    job.resolve = convertKernelsG.resolve[pixelFormatG];
+    job.frame = frame;
+    job.pitch = pitch;
+    (void) WorkerPool_Run(&workerPoolG, &Vector_DrawRows, &job, v->height,
+                          (size_t) v->width * v->height);
+
+    /* Every row was drawn afresh, and none can be reused for a texture */
+    frameArenaG.contents[buffer].valid = false;
+
+    slot->video.data = frame;
+    slot->video.width = v->width;
+    slot->video.height = v->height;
+    slot->video.pitch = pitch;
+    slot->video.borrowed = false;
+    slot->video_dupe = false;
+    slot->video_valid = true;
+
+    lastFrameG = slot->video;
+    lastFrameKeyG = key;
+    lastFrameValidG = true;
+}
+
+
+/* Converts the screen textures, or draws the vector screen, into the frame
+   slot being produced */
+static void RenderFrame(const LibMame_RenderPrimitive *render_primitive_list)
+{
+    const LibMame_RenderPrimitive *prims[COMPOSITOR_MAX_SCREENS];
+    unsigned int count = 0;
+
+    if (vectorScreenG.scale) {
+        DrawVectors(render_primitive_list, RunnerFrameSlot());
+        return;
+    }
+
+    /* Raster games are drawn from their screen quads alone */
+    for (const LibMame_RenderPrimitive *prim = render_primitive_list;
+         prim && (count < COMPOSITOR_MAX_SCREENS); prim = prim->next) {
+        if ((prim->type == LibMame_RenderPrimitiveType_Quad) &&
+            LIBMAME_RENDERFLAGS_SCREEN_TEXTURE(prim->flags)) {
+            prims[count++] = prim;
+        }
+    }
+
+    /* The common single screen case needs no compositing, and its texture
+       can sometimes be handed to the frontend as it is */
+    if (count == 1) {
+        ConvertTexture(prims[0],
+                       LIBMAME_RENDERFLAGS_TEXTURE_FORMAT(prims[0]->flags),
+                       RunnerFrameSlot());
+    }
+    else if (count) {
+        CompositeScreens(prims, count, RunnerFrameSlot());
+    }
+}
+
+
+static void UpdateVideoCb(const LibMame_RenderPrimitive *render_primitive_list,
+                          void *callback_data)
+{
+    (void) callback_data;
+
+    if (!retroVideoRefreshG || (frameFlagsG & FRAME_HIDE_VIDEO)) {
+        return;
+    }
+
+    uint64_t start = Profile_Begin();
+    RenderFrame(render_primitive_list);
+    if (exportG.header) {
+        Export_PublishFrame(&exportG, RunnerFrameSlot(),
+                            Handoff_Sequence(&fromRunnerG) + 1);
+    }
+    profileCallbacksNsG += Profile_End(ProfilePhase_Video, start);
 }
 
 
-static void UpdateAudioCb(int sample_rate, int frame_count, 
+/* The samples go into the audio ring; retro_run() delivers them */
+static void UpdateAudioCb(int sample_rate, int frame_count,
                           const int16_t *buffer, void *callback_data)
 {
+    (void) callback_data;
+
     runningGameSampleRateG = sample_rate;
 
-    if (retroAudioSampleBatchG) {
-        (retroAudioSampleBatchG)(buffer, samples_this_frame);
+    if ((frame_count <= 0) || (frameFlagsG & FRAME_HIDE_AUDIO)) {
+        return;
     }
-    else if (retroAudioSampleG) {
-        for (int i = 0; i < frame_count; i++) {
-            (retroAudioSampleG)(buffer, &(buffer[1]));
-            buffer = &(buffer[2]);
-        }
+
+    uint64_t start = Profile_Begin();
+    AudioRing_Write(&audioRingG, buffer, (uint32_t) frame_count,
+                    masterGainG);
+    if (exportG.header) {
+        Export_PublishAudio(&exportG, sample_rate, buffer,
+                            (uint32_t) frame_count, masterGainG,
+                            Handoff_Sequence(&fromRunnerG) + 1);
     }
+    profileCallbacksNsG += Profile_End(ProfilePhase_Audio, start);
 }
 
 
+/* attenuation is in dB, from 0 down to -32; it is applied as the samples
+   go into the audio ring */
 static void SetMasterVolumeCb(int attenuation, void *callback_data)
 {
-    (void) attenuation, (void) callback_data;
+    (void) callback_data;
+
+    if (attenuation > 0) {
+        attenuation = 0;
+    }
+    else if (attenuation < -AUDIO_MAX_ATTENUATION) {
+        attenuation = -AUDIO_MAX_ATTENUATION;
+    }
+
+    masterGainG = attenuationGainsG[-attenuation];
 }
 
 
@@ -563,28 +6584,73 @@ static void MakeRunningGameCallsCb(void *callback_data)
 {
     (void) callback_data;
 
-    pthread_mutex_lock(&mutexG);
+    /* Everything since the runner last resumed, other than the video and
+       audio callbacks, was MAME emulating */
+    if (profileEnabledG && profileResumeNsG) {
+        Profile_Record(ProfilePhase_Emulate,
+                       Profile_Now() - profileResumeNsG - profileCallbacksNsG);
+    }
 
     /* Signal done with this frame */
-    pthread_cond_signal(&fromRunnerCondG);
+    uint32_t completed = Handoff_Sequence(&fromRunnerG) + 1;
+    Handoff_Post(&fromRunnerG);
 
-    /* Now wait to be told to go again */
-    pthread_cond_wait(&toRunnerCondG, &mutexG);
+    /* Now wait to be told to go again; in pipelined mode the next frame may
+       already have been asked for by the time this one is done */
+    uint32_t ahead = pipelinedG ? 1 : 0;
+    uint64_t wait = Profile_Begin();
+    State_AwaitFrame(&stateChannelG, completed + 1 - ahead);
+
+    (void) Profile_End(ProfilePhase_RunnerWait, wait);
+    profileResumeNsG = Profile_Begin();
+    profileCallbacksNsG = 0;
+
+    bool stop = __atomic_load_n(&runningGameStopG, __ATOMIC_ACQUIRE);
+    bool reset = __atomic_exchange_n(&resetG, false, __ATOMIC_ACQ_REL);
 
     /* If it's time to exit this game, do so */
-    if (runningGameStopG) {
+    if (stop) {
         /* Time to exit */
         LibMame_RunningGame_Schedule_Exit(runningGameG);
     }
     /* Else if a reset has been requested, do so */
-    else if (resetG) {
+    else if (reset) {
         LibMame_RunningGame_Schedule_Soft_Reset(runningGameG);
-        resetG = false;
+    }
+
+    /* A save state request pauses the game until it is done */
+    if (!stop) {
+        (void) State_Begin(&stateChannelG);
     }
 }
 
 
+/* Only the core pauses the game, to make save states; see State_Begin() */
 static void PausedCb(void *callback_data)
 {
     (void) callback_data;
+
+    StateChannel *channel = &stateChannelG;
+    if (!channel->paused) {
+        return;
+    }
+
+    State_Finish(channel);
+
+    /* Wait for another request or for the next frame */
+    uint32_t ahead = pipelinedG ? 1 : 0;
+    State_AwaitFrame(channel, Handoff_Sequence(&fromRunnerG) + 1 - ahead);
+
+    if (__atomic_load_n(&runningGameStopG, __ATOMIC_ACQUIRE)) {
+        LibMame_RunningGame_Schedule_Exit(runningGameG);
+        return;
+    }
+    if (State_Begin(channel)) {
+        return;
+    }
+
+    LibMame_RunningGame_Schedule_Unpause(runningGameG);
+    channel->paused = false;
+    profileResumeNsG = Profile_Begin();
+    profileCallbacksNsG = 0;
 }
@@ -0,0 +1,439 @@
+/** **************************************************************************
+ * libretromame_bench.c
+ *
+ * Copyright 2012 Bryan Ischo <bryan@ischo.com>
+ *
+ * Headless benchmark driver for libretromame.  It is compiled together with
+ * the core, which it includes directly, so that the conversion and audio
+ * paths can be exercised without a frontend:
+ *
+ *     cc -O2 -o libretromame_bench libretromame_bench.c -lmame -lz -lm \
+ *         -lpthread
+ *
+ * Like the core, it needs libmame, zlib and the math and pthread libraries;
+ * with a glibc older than 2.17, add -lrt for shm_open().
+ *
+ * Usage:
+ *
+ *     libretromame_bench [-f frames] [-1555] <path to game>
+ *         Loads the game with null video, audio and input sinks, calls
+ *         retro_run() frames times (default 3600), and reports frames per
+ *         second followed by the per-phase frame profile.  -1555 refuses
+ *         XRGB8888 output so that the 0RGB1555 path is measured.
+ *
+ *     libretromame_bench -k [-i iterations]
+ *         Runs the microbenchmarks on synthetic textures and audio; no ROMs
+ *         are needed.
+ *
+ ************************************************************************** **/
+
+/* The core goes first, as it sets feature test macros */
+#include "libretromame.c"
+#include <stdio.h>
+
+
+/* ************************************************************************ */
+/* Null frontend
+/* ************************************************************************ */
+
+static bool benchRefuseXrgb8888G;
+static uint64_t benchVideoFramesG, benchDupedFramesG, benchAudioFramesG;
+
+
+static bool BenchEnvironment(unsigned cmd, void *data)
+{
+    switch (cmd) {
+    case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+        *((bool *) data) = true;
+        return true;
+    case RETRO_ENVIRONMENT_GET_VARIABLE:
+        /* Core defaults for everything; profiling is forced on through the
+           environment instead */
+        ((struct retro_variable *) data)->value = NULL;
+        return false;
+    case RETRO_ENVIRONMENT_SET_VARIABLES:
+        return true;
+    case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
+        *((const char **) data) = ".";
+        return true;
+    case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
+        return !(benchRefuseXrgb8888G &&
+                 (*((const enum retro_pixel_format *) data) ==
+                  RETRO_PIXEL_FORMAT_XRGB8888));
+    default:
+        return false;
+    }
+}
+
+
+static void BenchVideoRefresh(const void *data, unsigned width,
+                              unsigned height, size_t pitch)
+{
+    (void) width, (void) height, (void) pitch;
+
+    if (data) {
+        benchVideoFramesG += 1;
+    }
+    else {
+        benchDupedFramesG += 1;
+    }
+}
+
+
+static void BenchAudioSample(int16_t left, int16_t right)
+{
+    (void) left, (void) right;
+
+    benchAudioFramesG += 1;
+}
+
+
+static size_t BenchAudioSampleBatch(const int16_t *data, size_t frames)
+{
+    (void) data;
+
+    benchAudioFramesG += frames;
+
+    return frames;
+}
+
+
+static void BenchInputPoll()
+{
+}
+
+
+static int16_t BenchInputState(unsigned port, unsigned device,
+                               unsigned index, unsigned id)
+{
+    (void) port, (void) device, (void) index, (void) id;
+
+    return 0;
+}
+
+
+static void BenchSetCallbacks()
+{
+    retro_set_environment(BenchEnvironment);
+    retro_set_video_refresh(BenchVideoRefresh);
+    retro_set_audio_sample(BenchAudioSample);
+    retro_set_audio_sample_batch(BenchAudioSampleBatch);
+    retro_set_input_poll(BenchInputPoll);
+    retro_set_input_state(BenchInputState);
+}
+
+
+/* ************************************************************************ */
+/* Game benchmark
+/* ************************************************************************ */
+
+static int BenchGame(const char *path, unsigned int frames)
+{
+    /* The profile printed at unload is the per-phase breakdown */
+    (void) setenv("LIBRETROMAME_PROFILE", "1", 1);
+
+    BenchSetCallbacks();
+    retro_init();
+
+    struct retro_game_info info = { path, NULL, 0, NULL };
+    if (!retro_load_game(&info)) {
+        fprintf(stderr, "Failed to load %s\n", path);
+        retro_deinit();
+        return 1;
+    }
+
+    uint64_t start = Profile_Now();
+    for (unsigned int i = 0; i < frames; i++) {
+        retro_run();
+    }
+    uint64_t elapsed = Profile_Now() - start;
+
+    printf("%s: %u frames in %.3f s: %.2f fps (%llu presented, %llu duped, "
+           "%llu audio frames)\n", path, frames, elapsed / 1e9,
+           frames / (elapsed / 1e9), (unsigned long long) benchVideoFramesG,
+           (unsigned long long) benchDupedFramesG,
+           (unsigned long long) benchAudioFramesG);
+
+    retro_unload_game();
+    retro_deinit();
+
+    return 0;
+}
+
+
+/* ************************************************************************ */
+/* Microbenchmarks
+/* ************************************************************************ */
+
+typedef struct BenchTexture
+{
+    const char *name;
+    LibMame_TextureFormat format;
+    uint32_t width, height;
+    bool lut;
+} BenchTexture;
+
+static const BenchTexture benchTexturesG[] =
+{
+    { "palette16", LibMame_TextureFormat_Palette16, 320, 240, false },
+    { "palette16", LibMame_TextureFormat_Palette16, 640, 480, false },
+    { "rgb32", LibMame_TextureFormat_RGB32, 320, 240, false },
+    { "rgb32", LibMame_TextureFormat_RGB32, 640, 480, false },
+    { "rgb32+lut", LibMame_TextureFormat_RGB32, 640, 480, true },
+    { "yuy16", LibMame_TextureFormat_YUY16, 720, 480, false }
+};
+
+
+/* A texture row pitch wider than the texture, as MAME's usually are */
+#define BENCH_ROW_PADDING 16
+
+
+static void BenchFillTexture(LibMame_RenderPrimitive *prim,
+                             const BenchTexture *texture,
+                             uint32_t *palette)
+{
+    uint32_t rowpixels = texture->width + BENCH_ROW_PADDING;
+    size_t pixels = (size_t) rowpixels * texture->height;
+    uint32_t seed = 1;
+
+    memset(prim, 0, sizeof(*prim));
+    prim->type = LibMame_RenderPrimitiveType_Quad;
+    prim->texture.width = texture->width;
+    prim->texture.height = texture->height;
+    prim->texture.rowpixels = rowpixels;
+
+    if ((texture->format == LibMame_TextureFormat_RGB32) ||
+        (texture->format == LibMame_TextureFormat_ARGB32)) {
+        uint32_t *base = (uint32_t *) malloc(pixels * sizeof(uint32_t));
+        for (size_t i = 0; i < pixels; i++) {
+            base[i] = (seed = (seed * 1103515245) + 12345);
+        }
+        prim->texture.base = base;
+        prim->texture.palette = texture->lut ? palette : NULL;
+    }
+    else if (texture->format == LibMame_TextureFormat_YUY16) {
+        uint16_t *base = (uint16_t *) malloc(pixels * sizeof(uint16_t));
+        for (size_t i = 0; i < pixels; i++) {
+            base[i] = (seed = (seed * 1103515245) + 12345) >> 16;
+        }
+        prim->texture.base = base;
+        prim->texture.palette = texture->lut ? palette : NULL;
+    }
+    else {
+        /* Indices into a few thousand colours, like a typical game */
+        uint16_t *base = (uint16_t *) malloc(pixels * sizeof(uint16_t));
+        for (size_t i = 0; i < pixels; i++) {
+            base[i] = (seed = (seed * 1103515245) + 12345) >> 20;
+        }
+        prim->texture.base = base;
+        prim->texture.palette = palette;
+    }
+}
+
+
+static void BenchKernelSet(const char *kernels, unsigned int iterations,
+                           uint32_t *palette)
+{
+    (void) setenv("LIBRETROMAME_KERNELS", kernels, 1);
+    SelectConvertKernels();
+
+    for (int fmt = RETRO_PIXEL_FORMAT_0RGB1555;
+         fmt <= RETRO_PIXEL_FORMAT_XRGB8888; fmt++) {
+        pixelFormatG = (enum retro_pixel_format) fmt;
+        for (size_t i = 0;
+             i < (sizeof(benchTexturesG) / sizeof(benchTexturesG[0])); i++) {
+            const BenchTexture *texture = &(benchTexturesG[i]);
+            LibMame_RenderPrimitive prim;
+            BenchFillTexture(&prim, texture, palette);
+
+            /* Every iteration must look like a new picture, or the
+               unchanged frame and row detection would skip the conversion */
+            FrameSlot *slot = RunnerFrameSlot();
+            canDupeG = false;
+            uint64_t start = Profile_Now();
+            for (unsigned int j = 0; j < iterations; j++) {
+                lastFrameValidG = false;
+                FrameArena_Invalidate(&frameArenaG);
+                ConvertTexture(&prim, texture->format, slot);
+            }
+            uint64_t ns = (Profile_Now() - start) / iterations;
+            slot->video_valid = false;
+
+            printf("  %-7s %-10s %4ux%-4u -> %s: %8.1f us/frame ",
+                   convertKernelsG.name, texture->name, texture->width,
+                   texture->height, (fmt == RETRO_PIXEL_FORMAT_XRGB8888) ?
+                   "xrgb8888" : "0rgb1555", ns / 1e3);
+            if (slot->video.data == prim.texture.base) {
+                printf("(zero-copy)\n");
+            }
+            else {
+                printf("%8.1f Mpixel/s\n", ((double) texture->width *
+                                             texture->height * 1e3) / ns);
+            }
+
+            /* And the cost of recognizing an unchanged frame */
+            canDupeG = true;
+            lastFrameValidG = false;
+            ConvertTexture(&prim, texture->format, slot);
+            start = Profile_Now();
+            for (unsigned int j = 0; j < iterations; j++) {
+                ConvertTexture(&prim, texture->format, slot);
+            }
+            ns = (Profile_Now() - start) / iterations;
+            printf("  %-7s %-10s %4ux%-4u unchanged: %8.1f us/frame%s\n",
+                   convertKernelsG.name, texture->name, texture->width,
+                   texture->height, ns / 1e3,
+                   slot->video_dupe ? "" : " (not detected)");
+            slot->video_valid = false;
+
+            /* And of a frame where only a status bar over the top eighth of
+               the screen changes */
+            ConvertRowFn convert;
+            size_t srcpitch;
+            (void) TextureConverter(texture->format, &convert, &srcpitch);
+            srcpitch *= prim.texture.rowpixels;
+            start = Profile_Now();
+            for (unsigned int j = 0; j < iterations; j++) {
+                for (uint32_t y = 0; y < (texture->height / 8); y++) {
+                    ((uint8_t *) prim.texture.base)[y * srcpitch] += 1;
+                }
+                ConvertTexture(&prim, texture->format, slot);
+            }
+            ns = (Profile_Now() - start) / iterations;
+            printf("  %-7s %-10s %4ux%-4u 1/8 rows:  %8.1f us/frame\n",
+                   convertKernelsG.name, texture->name, texture->width,
+                   texture->height, ns / 1e3);
+            slot->video_valid = false;
+
+            free(prim.texture.base);
+        }
+    }
+
+    FrameArena_Free(&frameArenaG);
+}
+
+
+static void BenchAudio(unsigned int iterations)
+{
+    /* One 60 Hz frame of 48 kHz stereo */
+    int16_t buffer[2 * 800];
+    for (int i = 0; i < (2 * 800); i++) {
+        buffer[i] = (int16_t) ((i * 977) & 0xffff);
+    }
+
+    uint64_t start = Profile_Now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        UpdateAudioCb(48000, 800, buffer, NULL);
+        DeliverAudio();
+    }
+    uint64_t ns = (Profile_Now() - start) / iterations;
+
+    printf("  audio   800 frames/frame: %8.2f us/frame\n", ns / 1e3);
+
+    /* And for a frontend with only the single-sample callback */
+    retro_set_audio_sample_batch(NULL);
+    start = Profile_Now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        UpdateAudioCb(48000, 800, buffer, NULL);
+        DeliverAudio();
+    }
+    ns = (Profile_Now() - start) / iterations;
+    retro_set_audio_sample_batch(BenchAudioSampleBatch);
+
+    printf("  audio   800 frames/frame, single-sample: %8.2f us/frame\n",
+           ns / 1e3);
+
+    /* And with the master volume turned down */
+    SetMasterVolumeCb(-6, NULL);
+    start = Profile_Now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        UpdateAudioCb(48000, 800, buffer, NULL);
+        DeliverAudio();
+    }
+    ns = (Profile_Now() - start) / iterations;
+    SetMasterVolumeCb(0, NULL);
+
+    printf("  audio   800 frames/frame, -6 dB (%s): %8.2f us/frame\n",
+           convertKernelsG.name, ns / 1e3);
+}
+
+
+static int BenchKernels(unsigned int iterations)
+{
+    uint32_t *palette = (uint32_t *) malloc(65536 * sizeof(uint32_t));
+    uint32_t seed = 7;
+    for (int i = 0; i < 65536; i++) {
+        palette[i] = (seed = (seed * 1103515245) + 12345);
+    }
+
+    BenchSetCallbacks();
+
+    /* The same conversion helpers that retro_init() would start */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    WorkerPool_Create(&workerPoolG,
+                      (cpus > 1) ? ((unsigned int) cpus - 1) : 0);
+
+    printf("Conversion kernels (%u iterations, %u helper threads):\n",
+           iterations, workerPoolG.count);
+    BenchKernelSet("scalar", iterations, palette);
+    BenchKernelSet("best", iterations, palette);
+
+    WorkerPool_Destroy(&workerPoolG);
+
+    printf("Audio path (%u iterations):\n", iterations * 10);
+    BenchAudio(iterations * 10);
+
+    free(palette);
+
+    return 0;
+}
+
+
+/* ************************************************************************ */
+/* ************************************************************************ */
+
+static void Usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-f frames] [-1555] <path to game>\n"
+            "       %s -k [-i iterations]\n", program, program);
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int frames = 3600, iterations = 1000;
+    bool kernels = false;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && ((i + 1) < argc)) {
+            frames = (unsigned int) atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-i") && ((i + 1) < argc)) {
+            iterations = (unsigned int) atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-k")) {
+            kernels = true;
+        }
+        else if (!strcmp(argv[i], "-1555")) {
+            benchRefuseXrgb8888G = true;
+        }
+        else if (argv[i][0] != '-') {
+            path = argv[i];
+        }
+        else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (kernels) {
+        return BenchKernels(iterations ? iterations : 1);
+    }
+    else if (path) {
+        return BenchGame(path, frames);
+    }
+
+    Usage(argv[0]);
+    return 1;
+}